@@ -0,0 +1,229 @@
+#include "capture.h"
+
+#include <chrono>
+
+namespace chip8 {
+  frame_queue::frame_queue(): head(0), tail(0) {}
+
+  bool frame_queue::push(const frame& f) {
+    uint32_t t = tail.load(std::memory_order_relaxed);
+    if(t - head.load(std::memory_order_acquire) == CAPACITY) return false;
+
+    frames[t & (CAPACITY - 1)] = f;
+    tail.store(t + 1, std::memory_order_release);
+    return true;
+  }
+
+  bool frame_queue::pop(frame& f) {
+    uint32_t h = head.load(std::memory_order_relaxed);
+    if(h == tail.load(std::memory_order_acquire)) return false;
+
+    f = frames[h & (CAPACITY - 1)];
+    head.store(h + 1, std::memory_order_release);
+    return true;
+  }
+
+  static void put16(FILE* out, int val) {
+    fputc(val & 0xFF, out);
+    fputc(val >> 8, out);
+  }
+
+  gif_writer::gif_writer(const char* path, int scale)
+    : scale(scale), w(framebuffer::W * scale), h(framebuffer::H * scale),
+      have_pending(false) {
+    out = fopen(path, "wb");
+    if(!out) return;
+
+    fwrite("GIF89a", 1, 6, out);
+    put16(out, w);
+    put16(out, h);
+    fputc(0xF0, out); // global color table of 2 colors
+    fputc(0, out); // background color
+    fputc(0, out); // aspect ratio
+
+    static const uint8_t palette[6] = {0, 0, 0, 0xFF, 0xFF, 0xFF};
+    fwrite(palette, 1, 6, out);
+
+    // loop forever
+    static const uint8_t loop[19] = {0x21, 0xFF, 0x0B,
+                                     'N', 'E', 'T', 'S', 'C', 'A', 'P', 'E', '2', '.', '0',
+                                     0x03, 0x01, 0x00, 0x00, 0x00};
+    fwrite(loop, 1, sizeof(loop), out);
+  }
+
+  bool gif_writer::ok() {
+    return out != 0;
+  }
+
+  void gif_writer::add(const frame_queue::frame& f) {
+    if(have_pending) {
+      // convert ticks to centiseconds without accumulating rounding error
+      int delay = f.tick * 100 / 60 - pending.tick * 100 / 60;
+
+      // viewers don't honor delays under 2cs, so a frame that short is
+      // replaced by the next one rather than slowing the whole animation
+      if(delay < 2) {
+        memcpy(pending.rows, f.rows, sizeof(f.rows));
+        return;
+      }
+
+      write_frame(pending, delay);
+    }
+
+    pending = f;
+    have_pending = true;
+  }
+
+  // variable width lzw codes packed into 255 byte sub-blocks
+  struct lzw_out {
+    FILE* out;
+    uint8_t block[255];
+    int len;
+    uint32_t bits;
+    int nbits;
+
+    lzw_out(FILE* out): out(out), len(0), bits(0), nbits(0) {}
+
+    void code(int c, int size) {
+      bits |= c << nbits;
+      nbits += size;
+      while(nbits >= 8) {
+        byte(bits & 0xFF);
+        bits >>= 8;
+        nbits -= 8;
+      }
+    }
+
+    void byte(uint8_t b) {
+      block[len++] = b;
+      if(len == 255) flush();
+    }
+
+    void flush() {
+      if(!len) return;
+      fputc(len, out);
+      fwrite(block, 1, len, out);
+      len = 0;
+    }
+
+    void finish() {
+      if(nbits) byte(bits);
+      flush();
+      fputc(0, out);
+    }
+  };
+
+  void gif_writer::write_frame(const frame_queue::frame& f, int delay_cs) {
+    static const uint8_t gce[4] = {0x21, 0xF9, 0x04, 0x00};
+    fwrite(gce, 1, 4, out);
+    put16(out, delay_cs);
+    fputc(0, out); // no transparency
+    fputc(0, out);
+
+    fputc(0x2C, out);
+    put16(out, 0);
+    put16(out, 0);
+    put16(out, w);
+    put16(out, h);
+    fputc(0, out); // no local color table
+
+    const int MIN_SIZE = 2;
+    const int CLEAR = 1 << MIN_SIZE, END = CLEAR + 1;
+    fputc(MIN_SIZE, out);
+
+    // the alphabet is only the 2 colors, so the dictionary is a binary trie
+    static thread_local int next[4096][2];
+    int codes = END + 1;
+    int size = MIN_SIZE + 1;
+
+    lzw_out lzw(out);
+    lzw.code(CLEAR, size);
+    memset(next, 0, sizeof(next));
+
+    int prefix = -1;
+    for(int y = 0; y < h; y++) {
+      uint64_t row = f.rows[y / scale];
+      for(int x = 0; x < w; x++) {
+        int c = (row >> (framebuffer::W - 1 - x / scale)) & 1;
+
+        if(prefix < 0) { prefix = c; continue; }
+        if(next[prefix][c]) { prefix = next[prefix][c]; continue; }
+
+        lzw.code(prefix, size);
+        if(codes == 4096) {
+          // dictionary full, start over
+          lzw.code(CLEAR, size);
+          memset(next, 0, sizeof(next));
+          codes = END + 1;
+          size = MIN_SIZE + 1;
+        }
+        else {
+          next[prefix][c] = codes++;
+          if(codes > (1 << size) && size < 12) size++;
+        }
+        prefix = c;
+      }
+    }
+
+    lzw.code(prefix, size);
+    lzw.code(END, size);
+    lzw.finish();
+  }
+
+  void gif_writer::finish() {
+    if(!out) return;
+
+    if(have_pending) write_frame(pending, 100);
+    have_pending = false;
+
+    fputc(0x3B, out);
+    fclose(out);
+    out = 0;
+  }
+
+  gif_writer::~gif_writer() {
+    finish();
+  }
+
+  frame_capture::frame_capture(const char* path, int scale)
+    : gif(path, scale), have_last(false), dropped(0), running(true) {
+    encoder = std::thread(&frame_capture::encode, this);
+  }
+
+  bool frame_capture::ok() {
+    return gif.ok();
+  }
+
+  void frame_capture::push(const framebuffer& fb, uint64_t tick) {
+    if(have_last && !memcmp(last.rows, fb.rows, sizeof(fb.rows))) return;
+
+    last.tick = tick;
+    memcpy(last.rows, fb.rows, sizeof(fb.rows));
+    have_last = true;
+
+    if(!queue.push(last)) dropped++;
+  }
+
+  void frame_capture::encode() {
+    frame_queue::frame f;
+    while(true) {
+      bool stopping = !running;
+
+      while(queue.pop(f)) {
+        if(gif.ok()) gif.add(f);
+      }
+
+      if(stopping) break;
+      std::this_thread::sleep_for(std::chrono::milliseconds(5));
+    }
+
+    gif.finish();
+  }
+
+  frame_capture::~frame_capture() {
+    running = false;
+    encoder.join();
+
+    if(dropped) fprintf(stderr, "frame capture dropped %llu frames\n", (unsigned long long)dropped);
+  }
+}
@@ -0,0 +1,77 @@
+#ifndef __CAPTURE_H__
+#define __CAPTURE_H__
+
+#include "core.h"
+
+#include <cstdio>
+#include <atomic>
+#include <thread>
+#include <vector>
+
+namespace chip8 {
+  // single producer, single consumer ring of packed frames
+  struct frame_queue {
+    static const int CAPACITY = 256; // must be a power of 2
+
+    struct frame {
+      uint64_t tick; // in 60Hz timer ticks
+      uint64_t rows[framebuffer::H];
+    };
+
+    frame frames[CAPACITY];
+    alignas(64) std::atomic<uint32_t> head; // next frame to pop, owned by the consumer
+    alignas(64) std::atomic<uint32_t> tail; // next slot to fill, owned by the producer
+
+    frame_queue();
+
+    bool push(const frame& f); // false when full
+    bool pop(frame& f); // false when empty
+  };
+
+  // 2 color animated gif, each frame shown until the next one's tick
+  struct gif_writer {
+    FILE* out;
+    int scale;
+    int w, h;
+
+    bool have_pending;
+    frame_queue::frame pending; // waits for the next frame to know its delay
+
+    gif_writer(const char* path, int scale);
+
+    bool ok();
+
+    void add(const frame_queue::frame& f);
+    void write_frame(const frame_queue::frame& f, int delay_cs);
+    void finish();
+
+    ~gif_writer();
+  };
+
+  // copies frames off the emulation thread and encodes them on its own.
+  // a full queue drops frames instead of blocking the emulator
+  struct frame_capture: aligned_new<frame_capture> {
+    frame_queue queue;
+    gif_writer gif;
+
+    frame_queue::frame last; // last frame pushed, to skip unchanged ones
+    bool have_last;
+    uint64_t dropped;
+
+    std::atomic<bool> running;
+    std::thread encoder;
+
+    frame_capture(const char* path, int scale = 4);
+
+    bool ok();
+
+    // called from the emulation thread once per 60Hz tick
+    void push(const framebuffer& fb, uint64_t tick);
+
+    void encode();
+
+    ~frame_capture();
+  };
+}
+
+#endif //__CAPTURE_H__
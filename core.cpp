@@ -1,5 +1,12 @@
 #include "core.h"
+#include "trace.h"
+#include "detect.h"
+
+#ifndef NO_SDL
 #include "sdl.h"
+#endif
+
+#include <fstream>
 
 #ifdef DEBUG
 #define D
@@ -48,7 +55,85 @@ namespace chip8 {
                              "OP_restore_regs"
   };
 
-  cpu::cpu(int pc_start): pc(pc_start), sp(0) {}
+  const uint8_t font[0x50] = {
+                               0xF0, 0x90, 0x90, 0x90, 0xF0,
+                               0x20, 0x60, 0x20, 0x20, 0x70,
+                               0xF0, 0x10, 0xF0, 0x80, 0xF0,
+                               0xF0, 0x10, 0xF0, 0x10, 0xF0,
+                               0x90, 0x90, 0xF0, 0x10, 0x10,
+                               0xF0, 0x80, 0xF0, 0x10, 0xF0,
+                               0xF0, 0x80, 0xF0, 0x90, 0xF0,
+                               0xF0, 0x10, 0x20, 0x40, 0x40,
+                               0xF0, 0x90, 0xF0, 0x90, 0xF0,
+                               0xF0, 0x90, 0xF0, 0x10, 0xF0,
+                               0xF0, 0x90, 0xF0, 0x90, 0x90,
+                               0xE0, 0x90, 0xE0, 0x90, 0xE0,
+                               0xF0, 0x80, 0x80, 0x80, 0xF0,
+                               0xE0, 0x90, 0x90, 0x90, 0xE0,
+                               0xF0, 0x80, 0xF0, 0x80, 0xF0,
+                               0xF0, 0x80, 0xF0, 0x80, 0x80
+  };
+
+  quirks::quirks()
+    : shift_vy(false), load_store_i(false), jump_vx(false), vf_reset(false), clip(false) {}
+
+  const char* quirks::profiles[] = {"modern", "vip", "schip", 0};
+
+  bool quirks::profile(const char* name, quirks& ret) {
+    std::string n = name;
+    ret = quirks();
+    if(n == "modern") return true;
+
+    if(n == "vip") {
+      ret.shift_vy = ret.load_store_i = ret.vf_reset = ret.clip = true;
+      return true;
+    }
+
+    if(n == "schip") {
+      ret.jump_vx = ret.clip = true;
+      return true;
+    }
+
+    return false;
+  }
+
+  cpu::cpu(int pc_start): pc(pc_start), I(0), sp(0) {
+    memset(v, 0, sizeof(v));
+    memset(stack, 0, sizeof(stack));
+  }
+
+  prng::prng(uint64_t seed) {
+    this->seed(seed);
+  }
+
+  void prng::seed(uint64_t seed) {
+    for(int i = 0; i < 4; i += 2) {
+      uint64_t z = (seed += 0x9E3779B97F4A7C15ull);
+      z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+      z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+      z ^= z >> 31;
+      s[i] = z;
+      s[i + 1] = z >> 32;
+    }
+  }
+
+  static inline uint32_t rotl(uint32_t x, int k) {
+    return (x << k) | (x >> (32 - k));
+  }
+
+  uint32_t prng::next() {
+    uint32_t ret = rotl(s[1] * 5, 7) * 9;
+    uint32_t t = s[1] << 9;
+
+    s[2] ^= s[0];
+    s[3] ^= s[1];
+    s[1] ^= s[2];
+    s[0] ^= s[3];
+    s[2] ^= t;
+    s[3] = rotl(s[3], 11);
+
+    return ret;
+  }
 
   int combine(uint16_t up, uint16_t lo) {
     int ret = lo;
@@ -73,7 +158,13 @@ namespace chip8 {
     uint8_t lo = mem->get(pc++);
     D printf("%03x: %02x%02x\n", pc-2, up, lo);
 
+    return decode(up, lo);
+  }
+
+  cpu::instr cpu::decode(uint8_t up, uint8_t lo) {
     instr ret;
+    ret.op = -1;
+    ret.arg0 = ret.arg1 = ret.arg2 = 0;
     switch(up >> 4) {
     case 0:
       if(up == 0 && lo == 0xE0) { ret.op = OP_CLS; break; }
@@ -150,26 +241,40 @@ namespace chip8 {
   void cpu::update(addressable_t* mem,
                    runtime_t* r,
                    bool print) {
-    instr i = fetch_and_decode(mem);
+    uint16_t at = pc;
+    try {
+      instr i = fetch_and_decode(mem);
+
+      D printf("%d: %s\n", pc-2, i.to_string().c_str());
+      else if(print) printf("%d: %s\n", pc-2, i.to_string().c_str());
 
-    D printf("%d: %s\n", pc-2, i.to_string().c_str());
-    else if(print) printf("%d: %s\n", pc-2, i.to_string().c_str());
+      exec(i, mem, r);
+    }
+    catch(fault& f) {
+      f.pc = at;
+      throw;
+    }
+  }
 
+  template <typename addressable_t, typename runtime_t>
+  void cpu::exec(const instr& i,
+                 addressable_t* mem,
+                 runtime_t* r) {
     switch(i.op) {
     case OP_CLS: { r->clear(); break; }
-    case OP_RET: { pc = stack[--sp]; break; }
+    case OP_RET: { sp = mem_policy::stack(sp - 1); pc = stack[sp]; break; }
     case OP_SYS: { break; }
     case OP_JP: { pc = i.arg0; break; }
-    case OP_CALL: { stack[sp++] = pc; pc = i.arg0; break; }
+    case OP_CALL: { int s = mem_policy::stack(sp); stack[s] = pc; sp = s + 1; pc = i.arg0; break; }
     case OP_SEb: { if(v[i.arg0] == i.arg1) pc+=2; break; }
     case OP_SNEb: { if(v[i.arg0] != i.arg1) pc+=2; break; }
     case OP_SEr: { if(v[i.arg0] == v[i.arg1]) pc+=2; break; }
     case OP_LDb: { v[i.arg0] = i.arg1; break; }
     case OP_ADDb: { v[i.arg0] += i.arg1; break; }
     case OP_LDr: { v[i.arg0] = v[i.arg1]; break; }
-    case OP_ORr: { v[i.arg0] |= v[i.arg1]; break; }
-    case OP_ANDr: { v[i.arg0] &= v[i.arg1]; break; }
-    case OP_XORr: { v[i.arg0] ^= v[i.arg1]; break; }
+    case OP_ORr: { v[i.arg0] |= v[i.arg1]; if(q.vf_reset) v[0xF] = 0; break; }
+    case OP_ANDr: { v[i.arg0] &= v[i.arg1]; if(q.vf_reset) v[0xF] = 0; break; }
+    case OP_XORr: { v[i.arg0] ^= v[i.arg1]; if(q.vf_reset) v[0xF] = 0; break; }
     case OP_ADDr:
       {
         int result = v[i.arg0];
@@ -186,8 +291,9 @@ namespace chip8 {
     }
 
     case OP_SHR: {
-      v[0xF] = v[i.arg0] & 1;
-      v[i.arg0] >>= 1;
+      uint8_t src = v[q.shift_vy ? i.arg1 : i.arg0];
+      v[0xF] = src & 1;
+      v[i.arg0] = src >> 1;
       break;
     }
 
@@ -198,27 +304,33 @@ namespace chip8 {
     }
 
     case OP_SHL: {
-      v[0xF] = v[i.arg0] >> 7;
-      v[i.arg0] <<= 1;
+      uint8_t src = v[q.shift_vy ? i.arg1 : i.arg0];
+      v[0xF] = src >> 7;
+      v[i.arg0] = src << 1;
       break;
     }
 
     case OP_SNEr: { if(v[i.arg0] != v[i.arg1]) pc+=2; break; }
     case OP_LDi: { I = i.arg0; break; }
-    case OP_JPv: { pc = v[0] + i.arg0; break; }
+    case OP_JPv: { pc = v[q.jump_vx ? i.arg0 >> 8 : 0] + i.arg0; break; }
     case OP_RND: { v[i.arg0] = r->rand() & i.arg1; break; }
     case OP_DRW: { v[0xF] = r->draw(I, i.arg2, v[i.arg0], v[i.arg1]); break; }
     case OP_SKP: { if(r->get_key(v[i.arg0])) pc += 2; break; }
     case OP_SKNP: { if(!r->get_key(v[i.arg0])) pc += 2; break; }
     case OP_LDdt: { v[i.arg0] = r->delay_timer(); break; }
-    case OP_LDk: { v[i.arg0] = r->wait_key(); break; }
+    case OP_LDk: {
+      int key = r->wait_key();
+      if(key < 0) pc -= 2; // no key yet, execute this instruction again
+      else v[i.arg0] = key;
+      break;
+    }
     case OP_LDxdt: { r->delay_timer(v[i.arg0]); break; }
     case OP_LDxst: { r->sound_timer(v[i.arg0]); break; }
-    case OP_ADDi: { I += v[i.arg0]; break; }
+    case OP_ADDi: { I = mem_policy::index(I + v[i.arg0]); break; }
     case OP_LDf: { I = r->digit_sprite(v[i.arg0]); break; }
     case OP_LDbcd: { mem->write(I, r->bcd(v[i.arg0]), 3); break; }
-    case OP_backup_regs: { mem->write(I, v, i.arg0 + 1); break; }
-    case OP_restore_regs: { mem->read(I, v, i.arg0 + 1); break; }
+    case OP_backup_regs: { mem->write(I, v, i.arg0 + 1); if(q.load_store_i) I = mem_policy::index(I + i.arg0 + 1); break; }
+    case OP_restore_regs: { mem->read(I, v, i.arg0 + 1); if(q.load_store_i) I = mem_policy::index(I + i.arg0 + 1); break; }
     default:
       {
         std::cerr << "ignoring unknown instr: " << i.op << std::endl;
@@ -227,6 +339,186 @@ namespace chip8 {
     }
   }
 
+  static constexpr int fuse(int a, int b) {
+    return (a & 0xFF) << 8 | (b & 0xFF);
+  }
+
+  fusion::fusion(): enabled(0), profiled(0) {
+    memset(counts, 0, sizeof(counts));
+  }
+
+  int fusion::pair(int first, int second) {
+    switch(fuse(first, second)) {
+    case fuse(cpu::OP_LDi, cpu::OP_DRW): return LDi_DRW;
+    case fuse(cpu::OP_LDf, cpu::OP_DRW): return LDf_DRW;
+    case fuse(cpu::OP_SEb, cpu::OP_JP): return SEb_JP;
+    case fuse(cpu::OP_SNEb, cpu::OP_JP): return SNEb_JP;
+    case fuse(cpu::OP_ADDb, cpu::OP_SEb): return ADDb_SEb;
+    case fuse(cpu::OP_LDdt, cpu::OP_SEb): return LDdt_SEb;
+    default: return -1;
+    }
+  }
+
+  void fusion::count(int executed) {
+    profiled += executed;
+    if(profiled >= PROFILE_LENGTH) settle();
+  }
+
+  void fusion::settle() {
+    enabled = 0;
+    for(int i = 0; i < PAIRS; i++) {
+      if(profiled && (uint64_t)counts[i] * HOT_SHARE >= (uint64_t)profiled) enabled |= 1 << i;
+    }
+    profiled = -1;
+  }
+
+  bool fusion::load(const char* path) {
+    std::ifstream in(path);
+    if(!in) return false;
+
+    // lines like " 12.34%         1234  OP_LDi + OP_DRW"
+    bool any = false;
+    enabled = 0;
+    std::string line;
+    while(std::getline(in, line)) {
+      double share;
+      char a[32], b[32];
+      if(sscanf(line.c_str(), "%lf%% %*u %31s + %31s", &share, a, b) != 3) continue;
+      any = true;
+
+      int first = -1, second = -1;
+      for(int i = 0; i <= cpu::OP_restore_regs; i++) {
+        if(!strcmp(debug_str[i], a)) first = i;
+        if(!strcmp(debug_str[i], b)) second = i;
+      }
+
+      int k = pair(first, second);
+      if(k >= 0 && share * HOT_SHARE >= 100) enabled |= 1 << k;
+    }
+
+    if(any) profiled = -1;
+    return any;
+  }
+
+  template <typename addressable_t, typename runtime_t>
+  int cpu::run(addressable_t* mem,
+               runtime_t* r,
+               int n) {
+    int done = 0;
+
+    // the decoded instruction at pc, carried over from the previous
+    // iteration when it is still valid
+    instr cur;
+    bool have_cur = false;
+
+    // the instruction being run, or the first half of a fused pair, and
+    // the one a fault is blamed on
+    uint16_t start = pc, at = pc;
+    try {
+      while(done < n) {
+        start = at = pc;
+        uint16_t last = start; // address of the last instruction executed
+
+        if(!have_cur) cur = fetch_and_decode(mem);
+        else pc += 2;
+
+        // none of the first halves of a fused pair write memory, so decoding
+        // the second half up front sees the same bytes sequential execution
+        // would. pairs never straddle the end of the budget, and nothing is
+        // decoded past the end of memory, that is left to a plain fetch
+        instr next;
+        bool have_next = done + 2 <= n && pc + 1 < dram::SIZE;
+        if(have_next) next = decode(mem->get(pc), mem->get(pc + 1));
+
+        // while profiling every pair runs unfused and is only counted
+        int k = have_next ? fusion::pair(cur.op, next.op) : -1;
+        if(k >= 0 && pairs.profiled >= 0) {
+          pairs.counts[k]++;
+          k = -1;
+        }
+
+        bool fused = k >= 0 && pairs.enabled >> k & 1;
+        if(fused) {
+          switch(k) {
+          case fusion::LDi_DRW: {
+            pc += 2;
+            I = cur.arg0;
+            at = start + 2;
+            v[0xF] = r->draw(I, next.arg2, v[next.arg0], v[next.arg1]);
+            done += 2; last += 2;
+            break;
+          }
+          case fusion::LDf_DRW: {
+            pc += 2;
+            I = r->digit_sprite(v[cur.arg0]);
+            at = start + 2;
+            v[0xF] = r->draw(I, next.arg2, v[next.arg0], v[next.arg1]);
+            done += 2; last += 2;
+            break;
+          }
+          case fusion::SEb_JP: {
+            // the jump only runs when it isn't skipped
+            if(v[cur.arg0] == cur.arg1) { pc += 2; done += 1; }
+            else { pc = next.arg0; done += 2; last += 2; }
+            break;
+          }
+          case fusion::SNEb_JP: {
+            if(v[cur.arg0] != cur.arg1) { pc += 2; done += 1; }
+            else { pc = next.arg0; done += 2; last += 2; }
+            break;
+          }
+          case fusion::ADDb_SEb: {
+            pc += 2;
+            v[cur.arg0] += cur.arg1;
+            if(v[next.arg0] == next.arg1) pc += 2;
+            done += 2; last += 2;
+            break;
+          }
+          case fusion::LDdt_SEb: {
+            pc += 2;
+            v[cur.arg0] = r->delay_timer();
+            if(v[next.arg0] == next.arg1) pc += 2;
+            done += 2; last += 2;
+            break;
+          }
+          default:
+            fused = false;
+          }
+        }
+
+        have_cur = false;
+        if(!fused) {
+          exec(cur, mem, r);
+          done++;
+
+          // fell through to the instruction we already decoded, and nothing
+          // could have rewritten it
+          if(have_next && pc == start + 2 && cur.op != OP_LDbcd && cur.op != OP_backup_regs) {
+            cur = next;
+            have_cur = true;
+          }
+        }
+
+        // waiting on a key, or spinning on a jump to itself
+        if(pc == last) break;
+      }
+    }
+    catch(fault& f) {
+      f.pc = at;
+      throw;
+    }
+
+    if(pairs.profiled >= 0) pairs.count(done);
+    return done;
+  }
+
+  std::string fault::to_string() const {
+    char buf[128];
+    if(kind == STACK) snprintf(buf, sizeof(buf), "stack %s at pc %03x", addr < 0 ? "underflow" : "overflow", pc);
+    else snprintf(buf, sizeof(buf), "memory access at %x past the end, pc %03x", addr, pc);
+    return buf;
+  }
+
   std::ostream& cpu::dump_regs(std::ostream& os) {
     os << "pc=" << HEX(pc) << "\n";
     os << "I=" << HEX(I) << "\n";
@@ -243,41 +535,141 @@ namespace chip8 {
     return (os << std::endl);
   }
 
-  dram::dram() {
-    data = new uint8_t[SIZE];
+  dram_image::dram_image(): rom_size(0) {
+    memset(data, 0, SIZE);
+    memcpy(data, font, sizeof(font));
+  }
+
+  std::shared_ptr<const dram_image> dram_image::load(const char* path) {
+    std::ifstream rom_in(path, std::ios::binary | std::ios::ate);
+    if(!rom_in) return 0;
+
+    int size = rom_in.tellg();
+    if(size > SIZE - dram::ROM_START) return 0;
+    rom_in.seekg(std::ios::beg);
+
+    std::shared_ptr<dram_image> ret(new dram_image);
+    rom_in.read((char*)ret->data + dram::ROM_START, size);
+    ret->rom_size = size;
+    return ret;
+  }
+
+  std::shared_ptr<const dram_image> dram_image::create(const uint8_t* rom, int size) {
+    if(size < 0 || size > SIZE - dram::ROM_START) return 0;
+
+    std::shared_ptr<dram_image> ret(new dram_image);
+    memcpy(ret->data + dram::ROM_START, rom, size);
+    ret->rom_size = size;
+    return ret;
+  }
+
+  std::shared_ptr<const dram_image> dram_image::blank() {
+    static std::shared_ptr<const dram_image> ret(new dram_image);
+    return ret;
+  }
+
+  dram::dram(std::shared_ptr<const dram_image> image) {
+    map(image);
+  }
+
+  void dram::map(std::shared_ptr<const dram_image> image) {
+    this->image = image;
+    owned = 0;
+    used = 0;
+    for(int i = 0; i < PAGES; i++) {
+      pages[i] = image->data + i * PAGE_SIZE;
+    }
+  }
+
+  void dram::assign(const dram& other) {
+    map(other.image);
+    for(int i = 0; i < PAGES; i++) {
+      if(other.owned >> i & 1) memcpy(page_for_write(i), other.pages[i], PAGE_SIZE);
+    }
+  }
+
+  uint8_t* dram::page_for_write(int page) {
+    if(owned >> page & 1) return slot(slots[page]);
+
+    slots[page] = used++;
+    uint8_t* ret = slot(slots[page]);
+    memcpy(ret, pages[page], PAGE_SIZE);
+    pages[page] = ret;
+    owned |= 1 << page;
+    return ret;
   }
 
+  uint8_t* dram::slot(int n) {
+    if(n < INLINE_PAGES) return data + n * PAGE_SIZE;
+
+    if(!overflow) overflow.reset(new uint8_t[(PAGES - INLINE_PAGES) * PAGE_SIZE]);
+    return overflow.get() + (n - INLINE_PAGES) * PAGE_SIZE;
+  }
+
+  // accesses are split at page boundaries, and each piece goes through the
+  // policy, so one running off the end wraps or faults like single bytes do
   void dram::write(int addr, void* buf, int count) {
-    assert(addr + count < SIZE);
-    memcpy(data + addr, buf, count);
+    uint8_t* src = (uint8_t*)buf;
+    while(count > 0) {
+      int a = mem_policy::addr(addr);
+      int page = a >> PAGE_BITS, off = a & (PAGE_SIZE - 1);
+      int n = PAGE_SIZE - off < count ? PAGE_SIZE - off : count;
+
+      // rewriting what is already there doesn't need a private copy
+      if(owned >> page & 1 || memcmp(pages[page] + off, src, n))
+        memcpy(page_for_write(page) + off, src, n);
+
+      addr += n; src += n; count -= n;
+    }
   }
 
   void dram::read(int addr, void* buf, int count) {
-    assert(addr + count < SIZE);
-    memcpy(buf, data + addr, count);
+    uint8_t* dst = (uint8_t*)buf;
+    while(count > 0) {
+      int a = mem_policy::addr(addr);
+      int page = a >> PAGE_BITS, off = a & (PAGE_SIZE - 1);
+      int n = PAGE_SIZE - off < count ? PAGE_SIZE - off : count;
+      memcpy(dst, pages[page] + off, n);
+      addr += n; dst += n; count -= n;
+    }
   }
 
   template <typename itt>
   void dram::write(int addr, itt it, int count) {
-    uint8_t* d = data + addr;
     while(count--) {
-      *(d++) = (uint8_t)*(it++);
+      uint8_t val = (uint8_t)*(it++);
+      int a = mem_policy::addr(addr++);
+      int page = a >> PAGE_BITS, off = a & (PAGE_SIZE - 1);
+      if(owned >> page & 1 || pages[page][off] != val)
+        page_for_write(page)[off] = val;
     }
   }
 
   uint8_t dram::get(int addr) {
-    assert(addr < SIZE);
-    return data[addr];
+    int a = mem_policy::addr(addr);
+    return pages[a >> PAGE_BITS][a & (PAGE_SIZE - 1)];
+  }
+
+  int dram::load_rom(const char* path) {
+    std::shared_ptr<const dram_image> rom = dram_image::load(path);
+    if(!rom) return -1;
+
+    map(rom);
+    return rom->rom_size;
   }
 
-  debug_runtime::debug_runtime(): dt(0), st(0) {}
+  debug_runtime::debug_runtime(uint64_t seed): dt(0), st(0), rng(seed) {}
+
+  void debug_runtime::seed(uint64_t seed) {
+    rng.seed(seed);
+  }
 
   void debug_runtime::clear() {
     printf("clear\n");
   }
 
   uint8_t debug_runtime::rand() {
-    return ::rand();
+    return rng.next() >> 24;
   }
 
   bool debug_runtime::draw(int addr, int n, int x, int y) {
@@ -311,26 +703,115 @@ namespace chip8 {
     return digit * 16;
   }
 
-  // TODO: make this thread safe
   uint8_t* debug_runtime::bcd(int digit) {
-    static uint8_t temp[3];
-    temp[2] = digit % 10; digit /= 10;
-    temp[1] = digit % 10; digit /= 10;
-    temp[0] = digit % 10; digit /= 10;
-    return temp;
+    bcd_buf[2] = digit % 10; digit /= 10;
+    bcd_buf[1] = digit % 10; digit /= 10;
+    bcd_buf[0] = digit % 10; digit /= 10;
+    return bcd_buf;
+  }
+
+  framebuffer::framebuffer(): clip(false) {
+    clear();
+  }
+
+  void framebuffer::clear() {
+    memset(rows, 0, sizeof(rows));
+  }
+
+  bool framebuffer::draw(const uint8_t* sprite, int n, int x, int y) {
+    bool ret = false;
+    x %= W;
+    y %= H;
+    for(int i = 0; i < n; i++) {
+      if(clip && y + i >= H) break;
+
+      uint64_t line = (uint64_t)sprite[i] << (W - 8);
+      // rotating wraps the part of the sprite past the right edge to the
+      // left, shifting drops it
+      if(clip) line >>= x;
+      else if(x) line = line >> x | line << (W - x);
+
+      uint64_t& row = rows[(i + y) % H];
+      if(row & line) ret = true;
+      row ^= line;
+    }
+    return ret;
+  }
+
+  bool framebuffer::pixel(int x, int y) {
+    return (rows[y] >> (W - 1 - x)) & 1;
   }
 
   void debug_runtime::update_timers(int t) {
-    if(dt)dt--;
-    if(st)st--;
     dt = dt > t ? dt - t : 0;
     st = st > t ? st - t : 0;
   }
 
+  template <typename addressable_t>
+  headless_runtime<addressable_t>::headless_runtime(addressable_t* mem, uint64_t seed)
+    : debug_runtime(seed), mem(mem), keys(0), new_keys(0) {
+    mem->write(0, font, sizeof(font));
+  }
+
+  template <typename addressable_t>
+  void headless_runtime<addressable_t>::set_keys(uint16_t keys) {
+    new_keys = keys & ~this->keys;
+    this->keys = keys;
+  }
+
+  template <typename addressable_t>
+  void headless_runtime<addressable_t>::clear() {
+    fb.clear();
+  }
+
+  template <typename addressable_t>
+  bool headless_runtime<addressable_t>::draw(int addr, int n, int x, int y) {
+    uint8_t sprite[16];
+    for(int i = 0; i < n; i++) {
+      sprite[i] = mem->get(addr + i);
+    }
+    return fb.draw(sprite, n, x, y);
+  }
+
+  template <typename addressable_t>
+  int headless_runtime<addressable_t>::digit_sprite(int digit) {
+    return (digit & 0xF) * 5;
+  }
+
+  template <typename addressable_t>
+  bool headless_runtime<addressable_t>::get_key(int key) {
+    return (keys >> (key & 0xF)) & 1;
+  }
+
+  template <typename addressable_t>
+  int headless_runtime<addressable_t>::wait_key() {
+    if(!new_keys) return -1;
+
+    int key = 0;
+    while(!(new_keys & (1 << key))) key++;
+    new_keys &= ~(1 << key);
+    return key;
+  }
+
+  // the headless path is also built optimized into the env library, where the
+  // address-of trick below gets optimized away
+  template struct headless_runtime<dram>;
+  template void cpu::update<dram, headless_runtime<dram> >(dram*, headless_runtime<dram>*, bool);
+  template int cpu::run<dram, headless_runtime<dram> >(dram*, headless_runtime<dram>*, int);
+  template struct headless_runtime<checked_mem<dram> >;
+  template cpu::instr cpu::fetch_and_decode<checked_mem<dram> >(checked_mem<dram>*);
+  template void cpu::exec<checked_mem<dram>, headless_runtime<checked_mem<dram> > >(const instr&, checked_mem<dram>*, headless_runtime<checked_mem<dram> >*);
+
   // force instantiate the template functions
   void FORCE_DEFINE__core() {
     { auto _ = &dram::write<uint8_t*>; }
     { auto _ = &dram::write<const uint8_t*>; }
+#ifndef NO_SDL
     { auto _ = &cpu::update<dram, sdl_runtime<dram> >; }
+    { auto _ = &cpu::run<dram, sdl_runtime<dram> >; }
+    { auto _ = &cpu::update<traced_mem<dram>, sdl_runtime<dram> >; }
+    // the env library doesn't link the trace writer
+    { auto _ = &cpu::update<traced_mem<dram>, headless_runtime<dram> >; }
+#endif
   }
 }
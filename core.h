@@ -5,8 +5,38 @@
 #include <iostream>
 #include <cstring>
 #include <cassert>
+#include <memory>
+#include <string>
+#include <cstdlib>
+#include <new>
+
+// what happens when a program reaches past memory or the stack, picked at
+// compile time with -DCHIP8_MEM_POLICY=...
+#define CHIP8_MEM_WRAP 0 // addresses wrap to 12 bits like the hardware, no branches
+#define CHIP8_MEM_TRAP 1 // throws a chip8::fault for the host to report
+#define CHIP8_MEM_CHECKED 2 // asserts, for debug builds
+
+#ifndef CHIP8_MEM_POLICY
+#define CHIP8_MEM_POLICY CHIP8_MEM_WRAP
+#endif
 
 namespace chip8 {
+  // gives T an operator new that honours its alignment, which plain new
+  // ignores before c++17
+  template <typename T>
+  struct aligned_new {
+    static void* operator new(size_t size) {
+      void* p;
+      size_t align = alignof(T) < sizeof(void*) ? sizeof(void*) : alignof(T);
+      if(posix_memalign(&p, align, size)) throw std::bad_alloc();
+      return p;
+    }
+
+    static void operator delete(void* p) {
+      free(p);
+    }
+  };
+
   // contracts that should be fullfilled by object types, though they
   // are not enforced through CRTP
 
@@ -23,7 +53,7 @@ namespace chip8 {
     uint8_t rand() {} // generate a random byte
     bool draw(int addr, int n, int x, int y) {} // draw a sprite
     bool get_key(int key) {} // check if a key is pressed
-    int wait_key() {} // wait for a key to be pressed
+    int wait_key() {} // wait for a key to be pressed (-1 to retry the instruction later)
     uint8_t delay_timer() {} // get the delay timer
     uint8_t delay_timer(uint8_t val) {} // set the delay timer
     uint8_t sound_timer(uint8_t val) {} // set the sound timer
@@ -32,6 +62,61 @@ namespace chip8 {
   };
 
   extern const char* debug_str[];
+  extern const uint8_t font[0x50]; // digit sprites, loaded at address 0
+
+  // xoshiro128**, seeded through splitmix64
+  struct prng {
+    uint32_t s[4];
+
+    prng(uint64_t seed = 0);
+
+    void seed(uint64_t seed);
+    uint32_t next();
+  };
+
+  // behaviors that differ between chip8 interpreters, all off is what this
+  // emulator has always done
+  struct quirks {
+    bool shift_vy; // 8xy6/8xyE shift vy into vx (COSMAC VIP)
+    bool load_store_i; // Fx55/Fx65 leave I past the last register (COSMAC VIP)
+    bool jump_vx; // Bxnn jumps to xnn + vx instead of v0 (SCHIP)
+    bool vf_reset; // 8xy1/8xy2/8xy3 clear vf (COSMAC VIP)
+    bool clip; // sprites are cut off at the screen edges instead of wrapping
+
+    quirks();
+
+    static const char* profiles[]; // names accepted by profile, null terminated
+
+    // "modern", "vip" or "schip", returns false for anything else
+    static bool profile(const char* name, quirks& ret);
+  };
+
+  // which instruction pairs cpu::run dispatches as fused superinstructions.
+  // a cpu starts out profiling: it runs every pair unfused for
+  // PROFILE_LENGTH instructions, counting the pairs it has a handler for,
+  // and then enables the ones that made up at least 1 in HOT_SHARE of them.
+  // loading a profile from a training run skips the warm up
+  struct fusion {
+    enum { LDi_DRW, LDf_DRW, SEb_JP, SNEb_JP, ADDb_SEb, LDdt_SEb, PAIRS };
+
+    static const int PROFILE_LENGTH = 1 << 16;
+    static const int HOT_SHARE = 100;
+
+    uint8_t enabled; // bit n set when pair n is dispatched fused
+    int profiled; // instructions counted so far, -1 once settled
+    uint32_t counts[PAIRS];
+
+    fusion();
+
+    static int pair(int first, int second); // the handler for two ops, or -1
+
+    void count(int executed); // instructions run while profiling
+    void settle(); // enables the hot pairs and stops profiling
+
+    // reads the output of tracetool pairs, enabling the handled pairs with
+    // a big enough share. returns false if the file has no pairs in it
+    bool load(const char* path);
+  };
 
   struct cpu {
     struct instr {
@@ -40,7 +125,7 @@ namespace chip8 {
 
       std::string to_string() {
         char buf[256];
-        snprintf(buf, 256, "%x(%s): %x %x %x\n", op, debug_str[op], arg0, arg1, arg2);
+        snprintf(buf, 256, "%x(%s): %x %x %x\n", op, op < 0 ? "unknown" : debug_str[op], arg0, arg1, arg2);
         return std::string(buf);
       }
     };
@@ -89,36 +174,162 @@ namespace chip8 {
     uint16_t stack[16];
     uint16_t sp;
 
+    quirks q; // clip is up to the runtime's framebuffer
+    fusion pairs; // the fused pairs run dispatches, and their profile
+
     cpu(int pc_start);
 
     template <typename addressable_t>
     instr fetch_and_decode(addressable_t* mem);
 
+    static instr decode(uint8_t up, uint8_t lo);
+
     template <typename addressable_t, typename runtime_t>
     void update(addressable_t* mem, runtime_t* r, bool print = false);
 
+    template <typename addressable_t, typename runtime_t>
+    void exec(const instr& i, addressable_t* mem, runtime_t* r);
+
+    // execute up to n instructions, dispatching hot pairs as fused
+    // superinstructions. stops early when an instruction leaves pc at its
+    // own address, returns the number of instructions executed
+    template <typename addressable_t, typename runtime_t>
+    int run(addressable_t* mem, runtime_t* r, int n);
+
     std::ostream& dump_regs(std::ostream& os);
   };
 
-  struct dram: addressable {
+  // a read-only memory image (font + rom), shared by every dram running it
+  struct dram_image: aligned_new<dram_image> {
     static const int SIZE = 4096;
+
+    alignas(64) uint8_t data[SIZE];
+    int rom_size;
+
+    dram_image();
+
+    // returns null on failure
+    static std::shared_ptr<const dram_image> load(const char* path);
+    static std::shared_ptr<const dram_image> create(const uint8_t* rom, int size);
+    static std::shared_ptr<const dram_image> blank();
+  };
+
+  // thrown by trap_policy. cpu::update and cpu::run fill in the pc of the
+  // instruction that caused it
+  struct fault {
+    enum { MEMORY, STACK };
+
+    int kind;
+    int addr; // the address, or the stack pointer for stack faults
+    int pc; // -1 until the cpu fills it in
+
+    fault(int kind, int addr): kind(kind), addr(addr), pc(-1) {}
+
+    std::string to_string() const;
+  };
+
+  // every address and stack slot goes through one of these. index is for
+  // I, which wrap keeps in 12 bits and the others leave to the access
+  struct wrap_policy {
+    static int addr(int a) { return a & (dram_image::SIZE - 1); }
+    static int stack(int sp) { return sp & 0xF; }
+    static int index(int i) { return i & (dram_image::SIZE - 1); }
+  };
+
+  struct trap_policy {
+    static int addr(int a) {
+      if((unsigned)a >= dram_image::SIZE) throw fault(fault::MEMORY, a);
+      return a;
+    }
+
+    static int stack(int sp) {
+      if((unsigned)sp >= 16) throw fault(fault::STACK, sp);
+      return sp;
+    }
+
+    static int index(int i) { return i; }
+  };
+
+  struct checked_policy {
+    static int addr(int a) { assert((unsigned)a < dram_image::SIZE); return a; }
+    static int stack(int sp) { assert((unsigned)sp < 16); return sp; }
+    static int index(int i) { return i; }
+  };
+
+#if CHIP8_MEM_POLICY == CHIP8_MEM_TRAP
+  typedef trap_policy mem_policy;
+#elif CHIP8_MEM_POLICY == CHIP8_MEM_CHECKED
+  typedef checked_policy mem_policy;
+#else
+  typedef wrap_policy mem_policy;
+#endif
+
+  // memory is split into pages that point into a shared image until they
+  // are first written to, at which point the page is copied into a private
+  // slot. the first few slots are inline, most roms never write more
+  struct dram: addressable {
+    static const int SIZE = dram_image::SIZE;
     static const int ROM_START = 0x200;
+    static const int PAGE_BITS = 8;
+    static const int PAGE_SIZE = 1 << PAGE_BITS;
+    static const int PAGES = SIZE / PAGE_SIZE;
+    static const int INLINE_PAGES = 4;
+
+    // private slots, the rest are allocated together the first time they're
+    // needed. no more aligned than plain new guarantees, so anything holding
+    // a dram can still be heap allocated
+    alignas(16) uint8_t data[INLINE_PAGES * PAGE_SIZE];
+    std::unique_ptr<uint8_t[]> overflow;
+    const uint8_t* pages[PAGES]; // into a slot or the image
+    uint8_t slots[PAGES]; // the slot of page n, only valid where owned
+    uint16_t owned; // bit n set once page n has a slot
+    int used; // slots handed out
 
-    uint8_t* data;
+    std::shared_ptr<const dram_image> image;
 
-    dram();
+    dram(std::shared_ptr<const dram_image> image = dram_image::blank());
+    dram(const dram&) = delete;
+    dram& operator=(const dram&) = delete;
+
+    void map(std::shared_ptr<const dram_image> image); // forgets all private pages
+    void assign(const dram& other); // copies other's private pages, shares its image
+    uint8_t* page_for_write(int page);
+    uint8_t* slot(int n);
 
     void write(int addr, void* buf, int count);
     void read(int addr, void* buf, int count);
     template <typename itt> void write(int addr, itt it, int count);
     uint8_t get(int addr);
+
+    int load_rom(const char* path); // returns the rom size, or -1 on failure
+  };
+
+  // the 64x32 screen, one bit per pixel with the leftmost pixel in the high
+  // bit of each row
+  struct framebuffer {
+    static const int W = 64;
+    static const int H = 32;
+
+    uint64_t rows[H];
+    bool clip; // see quirks::clip
+
+    framebuffer();
+
+    void clear();
+    bool draw(const uint8_t* sprite, int n, int x, int y); // returns true on collision
+    bool pixel(int x, int y);
   };
 
   struct debug_runtime: runtime {
     uint8_t dt;
     uint8_t st;
 
-    debug_runtime();
+    prng rng;
+    uint8_t bcd_buf[3];
+
+    debug_runtime(uint64_t seed = 0);
+
+    void seed(uint64_t seed);
 
     void clear();
     uint8_t rand();
@@ -132,6 +343,27 @@ namespace chip8 {
     uint8_t* bcd(int digit);
     void update_timers(int t = 1);
   };
+
+  // runs without a window: the screen is only kept in memory and the keys
+  // are set by whoever drives the machine
+  template <typename addressable_t>
+  struct headless_runtime: debug_runtime {
+    addressable_t* mem;
+    framebuffer fb;
+
+    uint16_t keys; // bit n set when key n is down
+    uint16_t new_keys; // pressed by the last set_keys and not yet waited for
+
+    headless_runtime(addressable_t* mem, uint64_t seed = 0);
+
+    void set_keys(uint16_t keys);
+
+    void clear();
+    bool draw(int addr, int n, int x, int y);
+    int digit_sprite(int digit);
+    bool get_key(int key);
+    int wait_key();
+  };
 }
 
 #endif //__CORE_H__
@@ -0,0 +1,187 @@
+#include "detect.h"
+
+#include <thread>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cinttypes>
+#include <algorithm>
+
+#include <sys/stat.h>
+
+namespace chip8 {
+  // keys most games use to start and move, held for a third of a second
+  // every half second
+  static const uint8_t SCRIPT[] = {0x5, 0x4, 0x6, 0x8, 0x2, 0xA, 0xF, 0x1, 0x0, 0xE};
+
+  // how many of the 256 screen bytes share each value, as entropy. empty
+  // screens score 0, sprites a few bits, noise close to 8
+  static double entropy(const framebuffer& fb) {
+    int counts[256] = {0};
+    for(int y = 0; y < framebuffer::H; y++) {
+      for(int x = 0; x < 8; x++) counts[fb.rows[y] >> (x * 8) & 0xFF]++;
+    }
+
+    double ret = 0;
+    for(int i = 0; i < 256; i++) {
+      if(!counts[i]) continue;
+      double p = counts[i] / 256.0;
+      ret -= p * log2(p);
+    }
+    return ret;
+  }
+
+  static void run_profile(std::shared_ptr<const dram_image> image, int ticks, int ips,
+                          profile_result& res) {
+    dram ram;
+    checked_mem<dram> mem(&ram);
+    headless_runtime<checked_mem<dram> > r(&mem);
+    ram.map(image);
+
+    cpu core(dram::ROM_START);
+    core.q = res.q;
+    r.fb.clip = res.q.clip;
+
+    res.invalid = res.stack_errors = 0;
+    double entropy_sum = 0;
+    int samples = 0;
+
+    int per_tick = ips / 60 ? ips / 60 : 1;
+    for(int t = 0; t < ticks && !res.stack_errors; t++) {
+      int phase = t % 30;
+      r.set_keys(phase < 20 ? 1 << SCRIPT[t / 30 % sizeof(SCRIPT)] : 0);
+
+      for(int n = 0; n < per_tick; n++) {
+        uint16_t pc = core.pc;
+        cpu::instr i = core.fetch_and_decode(&mem);
+
+        if(i.op < 0 || i.op == cpu::OP_SYS) {
+          res.invalid++;
+          continue;
+        }
+
+        if((i.op == cpu::OP_CALL && core.sp >= 16) || (i.op == cpu::OP_RET && !core.sp)) {
+          res.stack_errors++;
+          break;
+        }
+
+        core.exec(i, &mem, &r);
+        if(core.pc == pc) break; // waiting on a key or the timer
+      }
+
+      r.update_timers(1);
+
+      if(t % 60 == 59) {
+        entropy_sum += entropy(r.fb);
+        samples++;
+      }
+    }
+
+    res.bad_access = mem.bad;
+    res.entropy = samples ? entropy_sum / samples : 0;
+
+    res.score = res.invalid * 10 + res.bad_access * 5 + res.stack_errors * 1000;
+    // nothing ever drawn, or a screen full of noise
+    if(res.entropy < .05) res.score += 50;
+    if(res.entropy > 5.5) res.score += 50;
+  }
+
+  std::vector<profile_result> score_profiles(std::shared_ptr<const dram_image> image,
+                                             int ticks, int ips) {
+    std::vector<profile_result> ret;
+    for(int i = 0; quirks::profiles[i]; i++) {
+      profile_result res;
+      res.name = quirks::profiles[i];
+      quirks::profile(quirks::profiles[i], res.q);
+      ret.push_back(res);
+    }
+
+    std::vector<std::thread> threads;
+    for(size_t i = 0; i < ret.size(); i++) {
+      threads.push_back(std::thread(run_profile, image, ticks, ips, std::ref(ret[i])));
+    }
+    for(auto& t: threads) t.join();
+
+    std::stable_sort(ret.begin(), ret.end(), [](const profile_result& a, const profile_result& b) {
+        return a.score < b.score;
+      });
+    return ret;
+  }
+
+  uint64_t rom_hash(const dram_image& image) {
+    uint64_t ret = 0xcbf29ce484222325ull;
+    for(int i = 0; i < image.rom_size; i++) {
+      ret ^= image.data[dram::ROM_START + i];
+      ret *= 0x100000001b3ull;
+    }
+    return ret;
+  }
+
+  quirk_cache::quirk_cache(const std::string& path): path(path) {
+    if(path.empty()) return;
+
+    FILE* in = fopen(path.c_str(), "r");
+    if(!in) return;
+
+    uint64_t hash;
+    char name[64];
+    while(fscanf(in, "%" SCNx64 " %63s", &hash, name) == 2) {
+      profiles[hash] = name;
+    }
+    fclose(in);
+  }
+
+  std::string quirk_cache::default_path() {
+    const char* dir = getenv("XDG_CACHE_HOME");
+    if(dir && *dir) return std::string(dir) + "/chip8-quirks";
+
+    const char* home = getenv("HOME");
+    if(home && *home) return std::string(home) + "/.cache/chip8-quirks";
+
+    return "";
+  }
+
+  bool quirk_cache::lookup(uint64_t hash, std::string& profile) {
+    std::map<uint64_t, std::string>::iterator it = profiles.find(hash);
+    if(it == profiles.end()) return false;
+
+    // a profile renamed or dropped since it was cached is a miss, so the
+    // rom gets detected again and the new line overrides this one
+    quirks q;
+    if(!quirks::profile(it->second.c_str(), q)) return false;
+
+    profile = it->second;
+    return true;
+  }
+
+  void quirk_cache::store(uint64_t hash, const std::string& profile) {
+    profiles[hash] = profile;
+    if(path.empty()) return;
+
+    size_t slash = path.rfind('/');
+    if(slash != std::string::npos && slash) mkdir(path.substr(0, slash).c_str(), 0755);
+
+    // appending keeps concurrent launchers from losing each other's entries,
+    // the last line for a hash wins on load
+    FILE* out = fopen(path.c_str(), "a");
+    if(!out) return;
+    fprintf(out, "%016" PRIx64 " %s\n", hash, profile.c_str());
+    fclose(out);
+  }
+
+  std::string detect_profile(std::shared_ptr<const dram_image> image, quirk_cache* cache,
+                             bool* cached) {
+    uint64_t hash = rom_hash(*image);
+
+    std::string ret;
+    if(cache && cache->lookup(hash, ret)) {
+      if(cached) *cached = true;
+      return ret;
+    }
+
+    ret = score_profiles(image)[0].name;
+    if(cache) cache->store(hash, ret);
+    if(cached) *cached = false;
+    return ret;
+  }
+}
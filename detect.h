@@ -0,0 +1,85 @@
+#ifndef __DETECT_H__
+#define __DETECT_H__
+
+#include "core.h"
+
+#include <cstring>
+#include <string>
+#include <vector>
+#include <map>
+#include <memory>
+
+namespace chip8 {
+  // forwards to the real memory, counting accesses past its end instead of
+  // making them, so a rom run with the wrong quirks can't take us down
+  template <typename addressable_t>
+  struct checked_mem: addressable {
+    addressable_t* mem;
+    int bad;
+
+    checked_mem(addressable_t* mem): mem(mem), bad(0) {}
+
+    bool in_range(int addr, int count) {
+      if(addr >= 0 && addr + count <= addressable_t::SIZE) return true;
+      bad++;
+      return false;
+    }
+
+    void write(int addr, void* buf, int count) {
+      if(in_range(addr, count)) mem->write(addr, buf, count);
+    }
+
+    template <typename itt>
+    void write(int addr, itt it, int count) {
+      if(in_range(addr, count)) mem->write(addr, it, count);
+    }
+
+    void read(int addr, void* buf, int count) {
+      if(in_range(addr, count)) mem->read(addr, buf, count);
+      else memset(buf, 0, count);
+    }
+
+    uint8_t get(int addr) { return in_range(addr, 1) ? mem->get(addr) : 0; }
+  };
+
+  // how a rom fared under one quirk profile, lower scores are better
+  struct profile_result {
+    std::string name;
+    quirks q;
+
+    int invalid; // unknown or machine code (0nnn) instructions
+    int stack_errors; // calls past the top or returns past the bottom, ends the run
+    int bad_access; // memory accesses past the end
+    double entropy; // mean over the sampled frames, in bits per screen byte
+
+    int score;
+  };
+
+  // runs the rom once per profile, each on its own thread with the same
+  // scripted key presses, for the given number of 60Hz ticks. best first,
+  // ties go to the earlier profile in quirks::profiles
+  std::vector<profile_result> score_profiles(std::shared_ptr<const dram_image> image,
+                                             int ticks = 3000, int ips = 1000);
+
+  uint64_t rom_hash(const dram_image& image); // FNV-1a over the rom bytes
+
+  // profiles picked for earlier roms, a line of "hash profile" per rom
+  struct quirk_cache {
+    std::string path;
+    std::map<uint64_t, std::string> profiles;
+
+    quirk_cache(const std::string& path = default_path()); // an empty path caches nothing
+
+    static std::string default_path(); // $XDG_CACHE_HOME or ~/.cache, chip8-quirks
+
+    bool lookup(uint64_t hash, std::string& profile); // only names in quirks::profiles
+    void store(uint64_t hash, const std::string& profile);
+  };
+
+  // the cached profile for this rom, or the best scoring one, which is then
+  // cached. sets cached to say which
+  std::string detect_profile(std::shared_ptr<const dram_image> image, quirk_cache* cache,
+                             bool* cached = 0);
+}
+
+#endif //__DETECT_H__
@@ -0,0 +1,292 @@
+#include "env.h"
+#include "core.h"
+
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <atomic>
+
+using namespace chip8;
+
+namespace {
+  struct env {
+    cpu core;
+    dram ram;
+    headless_runtime<dram> runtime;
+
+    uint32_t score; // last value read from the reward address
+    int steps;
+    bool faulted; // hit a fault under the trap memory policy, frozen until reset
+
+    env(std::shared_ptr<const dram_image> image)
+      : core(dram::ROM_START), ram(image), runtime(&ram), score(0), steps(0), faulted(false) {}
+
+    void assign(const env& other) {
+      core = other.core;
+      ram.assign(other.ram);
+
+      runtime.dt = other.runtime.dt;
+      runtime.st = other.runtime.st;
+      runtime.rng = other.runtime.rng;
+      runtime.fb = other.runtime.fb;
+      runtime.keys = other.runtime.keys;
+      runtime.new_keys = other.runtime.new_keys;
+
+      score = other.score;
+      steps = other.steps;
+      faulted = other.faulted;
+    }
+  };
+}
+
+struct chip8_state {
+  env e;
+
+  chip8_state(std::shared_ptr<const dram_image> image): e(image) {}
+};
+
+struct chip8_envs {
+  static const int CHUNK = 16; // environments handed to a thread at a time
+
+  std::shared_ptr<const dram_image> image;
+  std::vector<std::unique_ptr<env> > envs;
+
+  int instructions_per_frame;
+  int frames_per_step;
+
+  int reward_addr;
+  int reward_size;
+
+  int done_addr;
+  uint8_t done_value;
+  int max_steps;
+
+  // the calling thread and the workers split every batch between them
+  std::vector<std::thread> workers;
+  std::mutex m;
+  std::condition_variable work_cv, done_cv;
+  std::function<void(int)> job;
+  std::atomic<int> next;
+  int busy;
+  uint64_t generation;
+  bool stop;
+
+  chip8_envs(std::shared_ptr<const dram_image> image, int n, int threads)
+    : image(image), instructions_per_frame(10), frames_per_step(1),
+      reward_addr(0), reward_size(0), done_addr(-1), done_value(0), max_steps(0),
+      next(0), busy(0), generation(0), stop(false) {
+    for(int i = 0; i < n; i++) {
+      envs.push_back(std::unique_ptr<env>(new env(image)));
+    }
+
+    for(int i = 1; i < threads; i++) {
+      workers.push_back(std::thread(&chip8_envs::work, this));
+    }
+  }
+
+  ~chip8_envs() {
+    {
+      std::lock_guard<std::mutex> lock(m);
+      stop = true;
+    }
+    work_cv.notify_all();
+
+    for(auto& t: workers) {
+      t.join();
+    }
+  }
+
+  void run_chunks() {
+    int n = envs.size();
+    int i;
+    while((i = next.fetch_add(CHUNK)) < n) {
+      int end = i + CHUNK < n ? i + CHUNK : n;
+      for(; i < end; i++) {
+        job(i);
+      }
+    }
+  }
+
+  void work() {
+    uint64_t seen = 0;
+    std::unique_lock<std::mutex> lock(m);
+    while(true) {
+      work_cv.wait(lock, [&]() { return stop || generation != seen; });
+      if(stop) return;
+      seen = generation;
+
+      lock.unlock();
+      run_chunks();
+      lock.lock();
+
+      if(--busy == 0) done_cv.notify_one();
+    }
+  }
+
+  void parallel_for(std::function<void(int)> f) {
+    {
+      std::lock_guard<std::mutex> lock(m);
+      job = f;
+      next = 0;
+      busy = workers.size();
+      generation++;
+    }
+    work_cv.notify_all();
+
+    run_chunks();
+
+    std::unique_lock<std::mutex> lock(m);
+    done_cv.wait(lock, [&]() { return busy == 0; });
+  }
+
+  uint32_t read_score(env& e) {
+    uint32_t ret = 0;
+    for(int i = 0; i < reward_size; i++) {
+      ret = ret << 8 | e.ram.get(reward_addr + i);
+    }
+    return ret;
+  }
+
+  void write_obs(env& e, uint8_t* obs, int obs_format) {
+    framebuffer& fb = e.runtime.fb;
+
+    if(obs_format == CHIP8_OBS_BITS) {
+      for(int i = 0; i < framebuffer::H; i++) {
+        for(int j = 0; j < 8; j++) {
+          obs[i * 8 + j] = fb.rows[i] >> (56 - j * 8);
+        }
+      }
+      return;
+    }
+
+    for(int i = 0; i < framebuffer::H; i++) {
+      uint64_t row = fb.rows[i];
+      for(int j = framebuffer::W - 1; j >= 0; j--) {
+        obs[i * framebuffer::W + j] = row & 1;
+        row >>= 1;
+      }
+    }
+  }
+
+  void reset(int i, uint64_t seed) {
+    env& e = *envs[i];
+    // the pair profile is about the rom, not the episode
+    fusion pairs = e.core.pairs;
+    e.core = cpu(dram::ROM_START);
+    e.core.pairs = pairs;
+    e.ram.map(image);
+
+    e.runtime.seed(seed);
+    e.runtime.dt = e.runtime.st = 0;
+    e.runtime.fb.clear();
+    e.runtime.keys = e.runtime.new_keys = 0;
+
+    e.score = read_score(e);
+    e.steps = 0;
+    e.faulted = false;
+  }
+
+  void step(int i, uint16_t action, float& reward, uint8_t& done) {
+    env& e = *envs[i];
+    e.runtime.set_keys(action);
+
+    try {
+      for(int f = 0; f < frames_per_step && !e.faulted; f++) {
+        e.core.run(&e.ram, &e.runtime, instructions_per_frame);
+        e.runtime.update_timers(1);
+      }
+    }
+    catch(const fault&) {
+      e.faulted = true;
+    }
+    e.steps++;
+
+    uint32_t score = read_score(e);
+    reward = (float)((int64_t)score - e.score);
+    e.score = score;
+
+    done = e.faulted || (done_addr >= 0 && e.ram.get(done_addr) == done_value) ||
+      (max_steps && e.steps >= max_steps);
+  }
+};
+
+static int obs_size(int obs_format) {
+  return obs_format == CHIP8_OBS_BITS ? CHIP8_OBS_BITS_SIZE : CHIP8_OBS_BYTES_SIZE;
+}
+
+extern "C" {
+  chip8_envs* chip8_envs_create(int n, const uint8_t* rom, int rom_size, int threads) {
+    std::shared_ptr<const dram_image> image = dram_image::create(rom, rom_size);
+    if(!image || n < 1) return 0;
+
+    if(threads < 1) threads = 1;
+    return new chip8_envs(image, n, threads);
+  }
+
+  void chip8_envs_destroy(chip8_envs* e) {
+    delete e;
+  }
+
+  int chip8_envs_count(chip8_envs* e) {
+    return e->envs.size();
+  }
+
+  void chip8_envs_set_speed(chip8_envs* e, int instructions_per_frame, int frames_per_step) {
+    e->instructions_per_frame = instructions_per_frame;
+    e->frames_per_step = frames_per_step;
+  }
+
+  int chip8_envs_set_reward(chip8_envs* e, uint16_t addr, int size) {
+    size = size < 0 ? 0 : size > 2 ? 2 : size;
+    // read_score runs outside the fault handling, it must stay in bounds
+    if(addr + size > dram::SIZE) return 0;
+
+    e->reward_addr = addr;
+    e->reward_size = size;
+    return 1;
+  }
+
+  int chip8_envs_set_done(chip8_envs* e, int addr, uint8_t value, int max_steps) {
+    if(addr >= dram::SIZE) return 0;
+
+    e->done_addr = addr;
+    e->done_value = value;
+    e->max_steps = max_steps;
+    return 1;
+  }
+
+  void chip8_envs_reset(chip8_envs* e, const uint64_t* seeds, const uint8_t* mask,
+                        uint8_t* obs, int obs_format) {
+    int size = obs_size(obs_format);
+    e->parallel_for([&](int i) {
+        if(mask && !mask[i]) return;
+        e->reset(i, seeds ? seeds[i] : i);
+        if(obs) e->write_obs(*e->envs[i], obs + (size_t)i * size, obs_format);
+      });
+  }
+
+  void chip8_envs_step(chip8_envs* e, const uint16_t* actions,
+                       uint8_t* obs, int obs_format, float* rewards, uint8_t* dones) {
+    int size = obs_size(obs_format);
+    e->parallel_for([&](int i) {
+        e->step(i, actions ? actions[i] : 0, rewards[i], dones[i]);
+        if(obs) e->write_obs(*e->envs[i], obs + (size_t)i * size, obs_format);
+      });
+  }
+
+  chip8_state* chip8_envs_clone(chip8_envs* e, int i) {
+    chip8_state* ret = new chip8_state(e->image);
+    ret->e.assign(*e->envs[i]);
+    return ret;
+  }
+
+  void chip8_envs_restore(chip8_envs* e, int i, const chip8_state* s) {
+    e->envs[i]->assign(s->e);
+  }
+
+  void chip8_state_free(chip8_state* s) {
+    delete s;
+  }
+}
@@ -0,0 +1,66 @@
+#ifndef __ENV_H__
+#define __ENV_H__
+
+/* batched headless chip8 environments for reinforcement learning, with a
+ * plain C interface. every call that takes a buffer writes straight into
+ * it, laid out as one contiguous slot per environment */
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct chip8_envs chip8_envs;
+typedef struct chip8_state chip8_state;
+
+enum {
+  CHIP8_OBS_BITS = 0, /* 32 rows of 8 bytes, leftmost pixel in the high bit of the first byte */
+  CHIP8_OBS_BYTES = 1 /* 64x32 bytes, 0 or 1 */
+};
+
+#define CHIP8_OBS_BITS_SIZE 256
+#define CHIP8_OBS_BYTES_SIZE 2048
+
+/* returns null if the rom doesn't fit in memory */
+chip8_envs* chip8_envs_create(int n, const uint8_t* rom, int rom_size, int threads);
+void chip8_envs_destroy(chip8_envs* e);
+
+int chip8_envs_count(chip8_envs* e);
+
+/* one step runs frames_per_step frames of instructions_per_frame
+ * instructions each, ticking the timers once per frame */
+void chip8_envs_set_speed(chip8_envs* e, int instructions_per_frame, int frames_per_step);
+
+/* the reward is the change in the big endian, size byte (1 or 2) value at
+ * addr since the previous step. returns 0, keeping the previous setting, if
+ * the value doesn't fit in memory */
+int chip8_envs_set_reward(chip8_envs* e, uint16_t addr, int size);
+
+/* an environment is done when the byte at addr equals value, after a
+ * memory or stack fault (built with the trap memory policy), or after
+ * max_steps steps (0 for no limit). addr < 0 disables the memory check.
+ * returns 0, keeping the previous setting, if addr is past the end of memory */
+int chip8_envs_set_done(chip8_envs* e, int addr, uint8_t value, int max_steps);
+
+/* resets every environment whose mask entry is nonzero (all of them when
+ * mask is null), seeding environment i with seeds[i]. obs may be null */
+void chip8_envs_reset(chip8_envs* e, const uint64_t* seeds, const uint8_t* mask,
+                      uint8_t* obs, int obs_format);
+
+/* actions[i] is the key bitmask held during the step (bit n = key n).
+ * done environments are stepped anyway until they are reset */
+void chip8_envs_step(chip8_envs* e, const uint16_t* actions,
+                     uint8_t* obs, int obs_format, float* rewards, uint8_t* dones);
+
+/* snapshots of a whole machine for tree search, restorable into any
+ * environment of a batch running the same rom */
+chip8_state* chip8_envs_clone(chip8_envs* e, int i);
+void chip8_envs_restore(chip8_envs* e, int i, const chip8_state* s);
+void chip8_state_free(chip8_state* s);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /*__ENV_H__*/
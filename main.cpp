@@ -2,9 +2,20 @@
 #include <fstream>
 #include <thread>
 #include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <memory>
+#include <random>
+#include <map>
 
 #include "sdl.h"
 #include "core.h"
+#include "pool.h"
+#include "trace.h"
+#include "metrics.h"
+#include "capture.h"
+#include "shm.h"
+#include "detect.h"
 
 using namespace std;
 
@@ -28,17 +39,398 @@ void handle_key(int key) {
   }
 }
 
-int main() {
-  chip8::render_window win(1280,640);
+struct options {
+  vector<string> roms;
+  int threads;
+  int ips;
+  uint64_t seed;
+  const char* trace_path;
+  const char* metrics_path;
+  const char* capture_path;
+  const char* shm_name;
+  bool overlay;
+  int scale; // window pixels per chip8 pixel, 0 to fit the default window
+  int filter, mask; // postfx settings
+  chip8::quirks q;
+  bool auto_quirks; // detect the profile per rom instead of using q
+  chip8::fusion pairs; // profiled online unless loaded with -F
+  bool headless;
+  int duration_ms; // 0 runs until the window is closed
+};
+
+// parses a comma separated list like "epx,crt"
+bool parse_postfx(const string& list, options& opt) {
+  size_t start = 0;
+  while(start <= list.size()) {
+    size_t end = list.find(',', start);
+    if(end == string::npos) end = list.size();
+    string name = list.substr(start, end - start);
+
+    if(name == "nearest") opt.filter = chip8::postfx::NEAREST;
+    else if(name == "epx") opt.filter = chip8::postfx::EPX;
+    else if(name == "scanlines") opt.mask = chip8::postfx::SCANLINES;
+    else if(name == "crt") opt.mask = chip8::postfx::CRT;
+    else return false;
+
+    start = end + 1;
+  }
+  return true;
+}
+
+chip8::postfx make_postfx(const options& opt) {
+  return chip8::postfx(64, 32, opt.scale ? opt.scale : 1, opt.filter, opt.mask);
+}
+
+void usage() {
+  cerr << "usage: main [options] rom...\n"
+       << "  -i ips        instructions per second (600)\n"
+       << "  -q profile    quirks: modern, vip, schip or auto to detect them (modern)\n"
+       << "  -F pairs      fuse the hot pairs listed by tracetool pairs, instead of\n"
+       << "                profiling each rom as it starts\n"
+       << "  -x scale      window pixels per chip8 pixel, also the render scale\n"
+       << "  -p filters    post processing: nearest, epx, scanlines, crt\n"
+       << "  -H            headless, no window\n"
+       << "  -d ms         stop after this long\n"
+       << "  -j threads    emulation threads\n"
+       << "  -s seed       random seed\n"
+       << "  -t path       write a trace per rom to path.N\n"
+       << "  -c path.gif   capture a gif per rom to path.N.gif\n"
+       << "  -S name       publish each framebuffer to shared memory name.N\n"
+       << "  -m path       export metrics to path\n"
+       << "  -o            metrics overlay\n"
+       << "with no roms, asks for one and runs it with the debugger keys\n";
+}
+
+// out.gif becomes out.0.gif, out.1.gif, ...
+string numbered(const char* path, int i) {
+  string ret = path;
+  size_t dot = ret.rfind('.');
+  if(dot == string::npos || ret.find('/', dot) != string::npos) dot = ret.size();
+  ret.insert(dot, "." + to_string(i));
+  return ret;
+}
+
+// the quirks to run a rom with, detected and cached with -q auto
+chip8::quirks rom_quirks(const options& opt, const string& rom, shared_ptr<const chip8::dram_image> image) {
+  if(!opt.auto_quirks) return opt.q;
+
+  static chip8::quirk_cache cache;
+  bool cached;
+  string name = chip8::detect_profile(image, &cache, &cached);
+  cerr << rom << ": " << name << " quirks" << (cached ? " (cached)" : "") << endl;
+
+  chip8::quirks ret;
+  if(!chip8::quirks::profile(name.c_str(), ret)) {
+    cerr << rom << ": unknown quirk profile " << name << ", using the default" << endl;
+    return opt.q;
+  }
+  return ret;
+}
+
+void report_startup() {
+  cerr << "first instruction after "
+       << chip8::stats.startup_ns.load() / 1e6 << "ms" << endl;
+}
+
+// every rom on the worker pool, no SDL at all
+int run_headless(const options& opt) {
+  const vector<string>& roms = opt.roms;
+  if(opt.overlay) cerr << "the overlay needs a window, ignoring it" << endl;
+
+  vector<unique_ptr<chip8::headless_instance> > instances;
+  chip8::worker_pool<chip8::headless_instance> pool;
+  map<string, shared_ptr<const chip8::dram_image> > images;
+
+  for(size_t i = 0; i < roms.size(); i++) {
+    shared_ptr<const chip8::dram_image>& image = images[roms[i]];
+    if(!image) image = chip8::dram_image::load(roms[i].c_str());
+    if(!image) {
+      cerr << "failed to load rom: " << roms[i] << endl;
+      return 1;
+    }
+
+    chip8::headless_instance* inst = new chip8::headless_instance(opt.ips, opt.seed + i);
+    instances.push_back(unique_ptr<chip8::headless_instance>(inst));
+    inst->load(image);
+    inst->set_quirks(rom_quirks(opt, roms[i], image));
+    inst->core.pairs = opt.pairs;
+
+    if(opt.trace_path && !inst->start_trace((string(opt.trace_path) + "." + to_string(i)).c_str())) {
+      cerr << "failed to open trace: " << opt.trace_path << "." << i << endl;
+      return 1;
+    }
+
+    if(opt.capture_path) {
+      string path = numbered(opt.capture_path, i);
+      if(!inst->start_capture(path.c_str())) {
+        cerr << "failed to open capture: " << path << endl;
+        return 1;
+      }
+    }
+
+    if(opt.shm_name) {
+      string name = string(opt.shm_name) + "." + to_string(i);
+      if(!inst->start_shm(name.c_str())) {
+        cerr << "failed to publish framebuffer: " << name << endl;
+        return 1;
+      }
+    }
+
+    pool.add(inst);
+  }
+
+  unique_ptr<chip8::metrics_exporter> exporter;
+  if(opt.metrics_path) exporter.reset(new chip8::metrics_exporter(opt.metrics_path));
+
+  pool.start(opt.threads);
+
+  chrono::steady_clock::time_point deadline = chrono::steady_clock::now() + chrono::milliseconds(opt.duration_ms);
+  bool reported = false;
+
+  // without a deadline, run until every rom has halted
+  while(!opt.duration_ms || chrono::steady_clock::now() < deadline) {
+    if(!reported && chip8::stats.startup_ns.load() >= 0) {
+      report_startup();
+      reported = true;
+    }
+
+    bool running = false;
+    for(auto& inst: instances) running |= !inst->halted;
+    if(!running) break;
+
+    std::this_thread::sleep_for(std::chrono::milliseconds(16));
+  }
+
+  pool.stop();
+  return 0;
+}
+
+// run every rom in its own tile of a single window, emulated on a pool of
+// worker threads while this thread composites and routes input
+int run_tiled(const options& opt) {
+  const vector<string>& roms = opt.roms;
+  const char* trace_path = opt.trace_path;
+
+  int n = roms.size();
+  int cols = ceil(sqrt((double)n));
+  int rows = (n + cols - 1) / cols;
+
+  // either the tiles decide the window size or the other way around
+  int W = 1280, H = 640;
+  if(opt.scale) {
+    W = cols * 64 * opt.scale;
+    H = rows * 32 * opt.scale;
+  }
+
+  chip8::render_window win(W, H);
+  int tile_w = W / cols, tile_h = H / rows;
+
+  // keep the 2:1 aspect ratio of the chip8 screen
+  if(tile_w > tile_h * 2) tile_w = tile_h * 2;
+  else tile_h = tile_w / 2;
+
+  vector<unique_ptr<chip8::instance> > instances;
+  chip8::worker_pool<chip8::instance> pool;
+
+  // instances running the same rom share its memory image
+  map<string, shared_ptr<const chip8::dram_image> > images;
+
+  chip8::postfx fx = make_postfx(opt);
+
+  for(int i = 0; i < n; i++) {
+    chip8::render_window::view* view = win.add_view(win.create_rect(0, 0, fx.width(), fx.height()));
+    view->move((i % cols) * tile_w, (i / cols) * tile_h);
+    view->scale(tile_w, tile_h);
+
+    shared_ptr<const chip8::dram_image>& image = images[roms[i]];
+    if(!image) image = chip8::dram_image::load(roms[i].c_str());
+    if(!image) {
+      cerr << "failed to load rom: " << roms[i] << endl;
+      return 1;
+    }
+
+    chip8::instance* inst = new chip8::instance(opt.ips, opt.seed + i, view, fx);
+    inst->load(image);
+    inst->set_quirks(rom_quirks(opt, roms[i], image));
+    inst->core.pairs = opt.pairs;
+
+    if(trace_path && !inst->start_trace((string(trace_path) + "." + to_string(i)).c_str())) {
+      cerr << "failed to open trace: " << trace_path << "." << i << endl;
+      delete inst;
+      return 1;
+    }
+
+    if(opt.capture_path) {
+      string path = numbered(opt.capture_path, i);
+      if(!inst->start_capture(path.c_str())) {
+        cerr << "failed to open capture: " << path << endl;
+        delete inst;
+        return 1;
+      }
+    }
+
+    if(opt.shm_name) {
+      string name = string(opt.shm_name) + "." + to_string(i);
+      if(!inst->start_shm(name.c_str())) {
+        cerr << "failed to publish framebuffer: " << name << endl;
+        delete inst;
+        return 1;
+      }
+    }
+
+    instances.push_back(unique_ptr<chip8::instance>(inst));
+    pool.add(inst);
+  }
+
+  unique_ptr<chip8::metrics_overlay> overlay;
+  if(opt.overlay) overlay.reset(new chip8::metrics_overlay(&win));
+
+  unique_ptr<chip8::metrics_exporter> exporter;
+  if(opt.metrics_path) exporter.reset(new chip8::metrics_exporter(opt.metrics_path));
+
+  pool.start(opt.threads);
+
+  chrono::steady_clock::time_point deadline = chrono::steady_clock::now() + chrono::milliseconds(opt.duration_ms);
+  bool reported = false;
+
+  // wall time, cpu time would scale with the number of busy workers
+  chrono::steady_clock::time_point last = chrono::steady_clock::now();
+  while(!opt.duration_ms || chrono::steady_clock::now() < deadline) {
+    chrono::steady_clock::time_point now = chrono::steady_clock::now();
+    double elapsed_ms = chrono::duration<double, milli>(now - last).count();
+    last = now;
+
+    for(auto& inst: instances) {
+      inst->runtime.update(elapsed_ms);
+    }
+    if(overlay) overlay->update();
+
+    if(!win.update()) break;
+
+    if(!reported && chip8::stats.startup_ns.load() >= 0) {
+      report_startup();
+      reported = true;
+    }
+
+    std::this_thread::sleep_for(std::chrono::milliseconds(16));
+  }
+
+  pool.stop();
+  return 0;
+}
+
+int main(int argc, char** argv) {
+  options opt;
+  opt.threads = std::thread::hardware_concurrency();
+  opt.ips = 600;
+  opt.seed = random_device()();
+  opt.trace_path = 0;
+  opt.metrics_path = 0;
+  opt.capture_path = 0;
+  opt.shm_name = 0;
+  opt.overlay = false;
+  opt.scale = 0;
+  opt.filter = chip8::postfx::NEAREST;
+  opt.mask = chip8::postfx::NONE;
+  opt.auto_quirks = false;
+  opt.headless = false;
+  opt.duration_ms = 0;
+
+  for(int i = 1; i < argc; i++) {
+    string arg = argv[i];
+    if(arg == "-j" && i + 1 < argc) opt.threads = atoi(argv[++i]);
+    else if(arg == "-i" && i + 1 < argc) opt.ips = atoi(argv[++i]);
+    else if(arg == "-t" && i + 1 < argc) opt.trace_path = argv[++i];
+    else if(arg == "-s" && i + 1 < argc) opt.seed = strtoull(argv[++i], 0, 0);
+    else if(arg == "-m" && i + 1 < argc) opt.metrics_path = argv[++i];
+    else if(arg == "-c" && i + 1 < argc) opt.capture_path = argv[++i];
+    else if(arg == "-S" && i + 1 < argc) opt.shm_name = argv[++i];
+    else if(arg == "-o") opt.overlay = true;
+    else if(arg == "-x" && i + 1 < argc) opt.scale = atoi(argv[++i]);
+    else if(arg == "-p" && i + 1 < argc) {
+      if(!parse_postfx(argv[++i], opt)) {
+        cerr << "unknown filter: " << argv[i] << endl;
+        return 1;
+      }
+    }
+    else if(arg == "-q" && i + 1 < argc) {
+      opt.auto_quirks = string(argv[++i]) == "auto";
+      if(!opt.auto_quirks && !chip8::quirks::profile(argv[i], opt.q)) {
+        cerr << "unknown quirk profile: " << argv[i] << endl;
+        return 1;
+      }
+    }
+    else if(arg == "-F" && i + 1 < argc) {
+      if(!opt.pairs.load(argv[++i])) {
+        cerr << "no instruction pairs in: " << argv[i] << endl;
+        return 1;
+      }
+    }
+    else if(arg == "-H") opt.headless = true;
+    else if(arg == "-d" && i + 1 < argc) opt.duration_ms = atoi(argv[++i]);
+    else if(arg[0] == '-') {
+      usage();
+      return arg == "-h" ? 0 : 1;
+    }
+    else opt.roms.push_back(arg);
+  }
+
+  if(opt.headless) {
+    if(opt.roms.empty()) {
+      usage();
+      return 1;
+    }
+    return run_headless(opt);
+  }
+
+  if(!opt.roms.empty()) return run_tiled(opt);
+
+  unique_ptr<chip8::trace_writer> trace;
+  if(opt.trace_path) {
+    trace.reset(new chip8::trace_writer(opt.trace_path));
+    if(!trace->ok()) {
+      cerr << "failed to open trace: " << opt.trace_path << endl;
+      return 1;
+    }
+  }
+
+  unique_ptr<chip8::frame_capture> capture;
+  if(opt.capture_path) {
+    capture.reset(new chip8::frame_capture(opt.capture_path));
+    if(!capture->ok()) {
+      cerr << "failed to open capture: " << opt.capture_path << endl;
+      return 1;
+    }
+  }
+
+  unique_ptr<chip8::shm_publisher> shm;
+  if(opt.shm_name) {
+    shm.reset(new chip8::shm_publisher(opt.shm_name));
+    if(!shm->ok()) {
+      cerr << "failed to publish framebuffer: " << opt.shm_name << endl;
+      return 1;
+    }
+  }
+
+  int W = opt.scale ? 64 * opt.scale : 1280, H = W / 2;
+  chip8::render_window win(W, H);
   win.register_listener(handle_key);
 
   chip8::cpu cpu(chip8::dram::ROM_START);
   chip8::dram ram;
   // chip8::debug_runtime runtime;
 
-  chip8::render_window::view* view = win.add_view(win.create_rect(0, 0, 64, 32));
-  view->scale(1280,640);
-  chip8::sdl_runtime<chip8::dram> runtime(&ram, view);
+  chip8::postfx fx = make_postfx(opt);
+  chip8::render_window::view* view = win.add_view(win.create_rect(0, 0, fx.width(), fx.height()));
+  view->scale(W, H);
+  chip8::sdl_runtime<chip8::dram> runtime(&ram, view, fx);
+  runtime.seed(opt.seed);
+
+  unique_ptr<chip8::metrics_overlay> overlay;
+  if(opt.overlay) overlay.reset(new chip8::metrics_overlay(&win));
+
+  unique_ptr<chip8::metrics_exporter> exporter;
+  if(opt.metrics_path) exporter.reset(new chip8::metrics_exporter(opt.metrics_path));
 
   runtime.clear();
 
@@ -47,27 +439,40 @@ int main() {
     string rom_path = input<string>("ROM path: ");
     cout << endl;
 
-    ifstream rom_in(rom_path.c_str(), ios::binary | ios::ate);
-
-    int size = rom_in.tellg();
-    rom_in.seekg(ios::beg);
+    shared_ptr<const chip8::dram_image> image = chip8::dram_image::load(rom_path.c_str());
+    if(!image) {
+      cerr << "failed to load rom: " << rom_path << endl;
+      return 1;
+    }
 
-    uint8_t* rom = new uint8_t[size];
-    rom_in.read((char*)rom, size);
-    ram.write(chip8::dram::ROM_START, rom, size);
-    delete [] rom;
+    ram.map(image);
+    cpu.q = rom_quirks(opt, rom_path, image);
+    runtime.fb.clip = cpu.q.clip;
   }
 
   int acc = 0;
   int delta = 0;
+  uint64_t ticks = 0;
   clock_t last = clock();
   int timer_interval = CLOCKS_PER_SEC / 60;
   assert(timer_interval);
 
   while(win.update()) {
     runtime.update(delta * 1000 / (double)CLOCKS_PER_SEC);
+    if(overlay) overlay->update();
+
     if(state >= 0) {
-      cpu.update(&ram, &runtime, print);
+      try {
+        if(trace) trace->update(&cpu, &ram, &runtime, print);
+        else cpu.update(&ram, &runtime, print);
+      }
+      catch(const chip8::fault& f) {
+        // stop where it happened, the registers can still be dumped
+        cerr << f.to_string() << endl;
+        cpu.pc = f.pc;
+        state = -1;
+      }
+      chip8::stats.instructions.add();
     }
 
     if(print_regs) {
@@ -87,6 +492,9 @@ int main() {
     delta = clock() - last;
     acc += delta;
     runtime.update_timers(acc / timer_interval);
+    chip8::stats.timer_ticks.add(acc / timer_interval);
+    if(capture && acc >= timer_interval) capture->push(runtime.fb, ticks += acc / timer_interval);
+    if(shm && acc >= timer_interval) shm->publish(runtime.fb.rows, cpu.v, cpu.pc, cpu.I, cpu.sp, runtime.dt, runtime.st);
     acc %= timer_interval;
 
     last = clock();
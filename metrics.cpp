@@ -0,0 +1,176 @@
+#include "metrics.h"
+
+#include <cstdio>
+
+namespace chip8 {
+  metrics stats;
+
+  metrics::counter::counter() {
+    for(int i = 0; i < SLOTS; i++) {
+      slots[i].n = 0;
+    }
+  }
+
+  void metrics::counter::add(uint64_t n) {
+    slots[thread_slot()].n.fetch_add(n, std::memory_order_relaxed);
+  }
+
+  uint64_t metrics::counter::value() {
+    uint64_t ret = 0;
+    for(int i = 0; i < SLOTS; i++) {
+      ret += slots[i].n.load(std::memory_order_relaxed);
+    }
+    return ret;
+  }
+
+  metrics::histogram::histogram() {
+    for(int i = 0; i < SLOTS; i++) {
+      for(int j = 0; j < BUCKETS; j++) {
+        slots[i].buckets[j] = 0;
+      }
+      slots[i].sum = 0;
+      slots[i].count = 0;
+    }
+  }
+
+  void metrics::histogram::observe(uint64_t ns) {
+    int b = 0;
+    while(b < BUCKETS - 1 && ns > (256ull << b)) b++;
+
+    slot& s = slots[thread_slot()];
+    s.buckets[b].fetch_add(1, std::memory_order_relaxed);
+    s.sum.fetch_add(ns, std::memory_order_relaxed);
+    s.count.fetch_add(1, std::memory_order_relaxed);
+  }
+
+  void metrics::histogram::snapshot(uint64_t* buckets, uint64_t& sum, uint64_t& count) {
+    sum = count = 0;
+    for(int j = 0; j < BUCKETS; j++) {
+      buckets[j] = 0;
+    }
+
+    for(int i = 0; i < SLOTS; i++) {
+      for(int j = 0; j < BUCKETS; j++) {
+        buckets[j] += slots[i].buckets[j].load(std::memory_order_relaxed);
+      }
+      sum += slots[i].sum.load(std::memory_order_relaxed);
+      count += slots[i].count.load(std::memory_order_relaxed);
+    }
+  }
+
+  metrics::scope::scope(histogram& h): h(stats.enabled ? &h : 0) {
+    if(this->h) start = clock::now();
+  }
+
+  metrics::scope::~scope() {
+    if(h) h->observe(std::chrono::duration_cast<std::chrono::nanoseconds>(clock::now() - start).count());
+  }
+
+  metrics::metrics(): enabled(false), start(clock::now()), startup_ns(-1) {}
+
+  bool metrics::first_instruction() {
+    if(startup_ns.load(std::memory_order_relaxed) >= 0) return false;
+
+    int64_t expected = -1;
+    int64_t ns = std::chrono::duration_cast<std::chrono::nanoseconds>(clock::now() - start).count();
+    return startup_ns.compare_exchange_strong(expected, ns);
+  }
+
+  int metrics::thread_slot() {
+    static std::atomic<int> next(0);
+    static thread_local int ret = next++ % SLOTS;
+    return ret;
+  }
+
+  static void put_counter(std::string& out, const char* name, const char* help, uint64_t val) {
+    char buf[256];
+    snprintf(buf, sizeof(buf), "# HELP %s %s\n# TYPE %s counter\n%s %llu\n",
+             name, help, name, name, (unsigned long long)val);
+    out += buf;
+  }
+
+  static void put_histogram(std::string& out, const char* name, const char* help, metrics::histogram& h) {
+    uint64_t buckets[metrics::BUCKETS], sum, count;
+    h.snapshot(buckets, sum, count);
+
+    char buf[256];
+    snprintf(buf, sizeof(buf), "# HELP %s %s\n# TYPE %s histogram\n", name, help, name);
+    out += buf;
+
+    uint64_t acc = 0;
+    for(int j = 0; j < metrics::BUCKETS - 1; j++) {
+      acc += buckets[j];
+      snprintf(buf, sizeof(buf), "%s_bucket{le=\"%g\"} %llu\n",
+               name, (256ull << j) * 1e-9, (unsigned long long)acc);
+      out += buf;
+    }
+
+    snprintf(buf, sizeof(buf), "%s_bucket{le=\"+Inf\"} %llu\n%s_sum %g\n%s_count %llu\n",
+             name, (unsigned long long)count, name, sum * 1e-9, name, (unsigned long long)count);
+    out += buf;
+  }
+
+  std::string metrics::prometheus() {
+    std::string ret;
+    char buf[128];
+
+    double uptime = std::chrono::duration<double>(clock::now() - start).count();
+    snprintf(buf, sizeof(buf), "# TYPE chip8_uptime_seconds gauge\nchip8_uptime_seconds %g\n", uptime);
+    ret += buf;
+
+    int64_t startup = startup_ns.load(std::memory_order_relaxed);
+    if(startup >= 0) {
+      snprintf(buf, sizeof(buf), "# TYPE chip8_startup_seconds gauge\nchip8_startup_seconds %g\n", startup * 1e-9);
+      ret += buf;
+    }
+
+    put_counter(ret, "chip8_instructions_total", "Instructions executed", instructions.value());
+    put_counter(ret, "chip8_timer_ticks_total", "60Hz timer ticks applied", timer_ticks.value());
+    put_counter(ret, "chip8_frames_total", "Frames presented", frames.value());
+
+    put_histogram(ret, "chip8_render_update_seconds", "Time in render_window::update", render_update);
+    put_histogram(ret, "chip8_present_seconds", "Time in SDL_RenderPresent", present);
+    put_histogram(ret, "chip8_runtime_update_seconds", "Time in sdl_runtime::update", runtime_update);
+    put_histogram(ret, "chip8_draw_seconds", "Time in sdl_runtime::draw", draw);
+
+    return ret;
+  }
+
+  bool metrics::write_prometheus(const char* path) {
+    std::string tmp = std::string(path) + ".tmp";
+    FILE* out = fopen(tmp.c_str(), "w");
+    if(!out) return false;
+
+    std::string text = prometheus();
+    bool ok = fwrite(text.data(), 1, text.size(), out) == text.size();
+    ok = !fclose(out) && ok;
+
+    return ok && !rename(tmp.c_str(), path);
+  }
+
+  metrics_exporter::metrics_exporter(const char* path, int interval_ms)
+    : path(path), interval(interval_ms), running(true) {
+    stats.enabled = true;
+    worker = std::thread(&metrics_exporter::work, this);
+  }
+
+  void metrics_exporter::work() {
+    std::unique_lock<std::mutex> lock(m);
+    while(running) {
+      stats.write_prometheus(path.c_str());
+      cv.wait_for(lock, interval);
+    }
+
+    // leave the final numbers behind
+    stats.write_prometheus(path.c_str());
+  }
+
+  metrics_exporter::~metrics_exporter() {
+    {
+      std::lock_guard<std::mutex> lock(m);
+      running = false;
+    }
+    cv.notify_all();
+    worker.join();
+  }
+}
@@ -0,0 +1,102 @@
+#ifndef __METRICS_H__
+#define __METRICS_H__
+
+#include <cstdint>
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <string>
+
+namespace chip8 {
+  // process wide counters and histograms. every thread writes to its own
+  // cache line sized slot with relaxed atomics, readers sum the slots
+  struct metrics {
+    typedef std::chrono::steady_clock clock;
+
+    static const int SLOTS = 16;
+    static const int BUCKETS = 24; // bucket i holds samples up to 256ns << i
+
+    struct counter {
+      struct alignas(64) slot {
+        std::atomic<uint64_t> n;
+      };
+      slot slots[SLOTS];
+
+      counter();
+
+      void add(uint64_t n = 1);
+      uint64_t value();
+    };
+
+    struct histogram {
+      struct alignas(64) slot {
+        std::atomic<uint64_t> buckets[BUCKETS];
+        std::atomic<uint64_t> sum; // in ns
+        std::atomic<uint64_t> count;
+      };
+      slot slots[SLOTS];
+
+      histogram();
+
+      void observe(uint64_t ns);
+      void snapshot(uint64_t* buckets, uint64_t& sum, uint64_t& count);
+    };
+
+    // times its own lifetime into a histogram, does nothing when disabled
+    struct scope {
+      histogram* h;
+      clock::time_point start;
+
+      scope(histogram& h);
+      ~scope();
+    };
+
+    bool enabled;
+    clock::time_point start; // during static initialization, close enough to exec
+
+    std::atomic<int64_t> startup_ns; // start to the first instruction, -1 until then
+
+    counter instructions;
+    counter timer_ticks;
+    counter frames; // frames presented
+
+    histogram render_update; // render_window::update
+    histogram present; // SDL_RenderPresent
+    histogram runtime_update; // sdl_runtime::update
+    histogram draw; // sdl_runtime::draw
+
+    metrics();
+
+    static int thread_slot();
+
+    // call once instructions have run, only the first call counts. returns
+    // true for that one
+    bool first_instruction();
+
+    std::string prometheus();
+    bool write_prometheus(const char* path); // atomically replaces path
+  };
+
+  extern metrics stats;
+
+  // rewrites a prometheus text file on a background thread
+  struct metrics_exporter {
+    std::string path;
+    std::chrono::milliseconds interval;
+
+    std::mutex m;
+    std::condition_variable cv;
+    bool running;
+    std::thread worker;
+
+    metrics_exporter(const char* path, int interval_ms = 1000);
+
+    void work();
+
+    ~metrics_exporter();
+  };
+}
+
+#endif //__METRICS_H__
@@ -0,0 +1,290 @@
+#include "pool.h"
+
+namespace chip8 {
+  // only a window delivers keys as they happen, a headless instance sees
+  // them on its next step like any other change
+  template <typename addressable_t>
+  static bool waiting_key(const sdl_runtime<addressable_t>& r) { return r.waiting; }
+  template <typename addressable_t>
+  static bool waiting_key(const headless_runtime<addressable_t>& r) { return false; }
+
+  template <typename addressable_t>
+  static bool key_pending(const sdl_runtime<addressable_t>& r) { return r.last != -1; }
+  template <typename addressable_t>
+  static bool key_pending(const headless_runtime<addressable_t>& r) { return false; }
+
+  template <typename addressable_t>
+  static void on_key(sdl_runtime<addressable_t>& r, std::function<void()> fn) { r.on_key = fn; }
+  template <typename addressable_t>
+  static void on_key(headless_runtime<addressable_t>& r, std::function<void()> fn) {}
+
+  template <typename runtime_t>
+  bool basic_instance<runtime_t>::load(const char* rom_path) {
+    return ram.load_rom(rom_path) >= 0;
+  }
+
+  template <typename runtime_t>
+  void basic_instance<runtime_t>::load(std::shared_ptr<const dram_image> image) {
+    ram.map(image);
+  }
+
+  template <typename runtime_t>
+  bool basic_instance<runtime_t>::start_trace(const char* path) {
+    trace.reset(new trace_writer(path));
+    return trace->ok();
+  }
+
+  template <typename runtime_t>
+  bool basic_instance<runtime_t>::start_capture(const char* path) {
+    capture.reset(new frame_capture(path));
+    return capture->ok();
+  }
+
+  template <typename runtime_t>
+  bool basic_instance<runtime_t>::start_shm(const char* name) {
+    shm.reset(new shm_publisher(name));
+    return shm->ok();
+  }
+
+  template <typename runtime_t>
+  void basic_instance<runtime_t>::set_quirks(const quirks& q) {
+    core.q = q;
+    runtime.fb.clip = q.clip;
+  }
+
+  template <typename runtime_t>
+  int basic_instance<runtime_t>::step(clock::time_point now) {
+    if(halted) return HALTED;
+
+    double elapsed = std::chrono::duration<double>(now - last).count();
+    last = now;
+
+    // the timers keep running while we wait, but they can't go lower than 0
+    timer_acc += elapsed < 5 ? elapsed * 60 : 300;
+    int tick = (int)timer_acc;
+    runtime.update_timers(tick);
+    stats.timer_ticks.add(tick);
+    timer_acc -= tick;
+    ticks += tick;
+
+    // don't try to catch up after a long stall
+    instr_acc += (elapsed < .1 ? elapsed : .1) * ips;
+
+    int state = RUNNABLE;
+    int n = instr_acc < BUDGET ? (int)instr_acc : BUDGET;
+    instr_acc -= n;
+
+    int executed = 0;
+    try {
+      if(trace) {
+        // traces need to see every instruction on its own
+        while(executed < n) {
+          uint16_t pc = core.pc;
+          trace->update(&core, &ram, &runtime);
+          executed++;
+          if(core.pc == pc) break;
+        }
+      }
+      else {
+        executed = core.run(&ram, &runtime, n);
+      }
+    }
+    catch(const fault& f) {
+      std::cerr << "halting instance: " << f.to_string() << std::endl;
+      halted = true;
+    }
+    stats.instructions.add(executed);
+    if(executed) stats.first_instruction();
+
+    // one frame per timer tick, whatever was drawn by the end of the step
+    if(capture && tick) capture->push(runtime.fb, ticks);
+    if(shm && tick) shm->publish(runtime.fb.rows, core.v, core.pc, core.I, core.sp, runtime.dt, runtime.st);
+
+    // waiting on a key, or spinning in a loop
+    if(executed < n) {
+      instr_acc = 0;
+      state = waiting_key(runtime) ? WAIT_KEY : WAIT_TIME;
+    }
+
+    if(halted) return HALTED;
+    if(state == RUNNABLE && instr_acc >= 1) return RUNNABLE;
+
+    if(state == WAIT_KEY) return WAIT_KEY;
+
+    if(state == WAIT_TIME) {
+      // only a timer tick can change anything now
+      wake_at = now + std::chrono::microseconds((int)((1 - timer_acc) * 1e6 / 60));
+    }
+    else {
+      // sleep until the next instruction is due, but not for less than 1ms
+      // so we don't wake up for every single instruction
+      double wait = (1 - instr_acc) / ips;
+      wake_at = now + std::chrono::microseconds(wait > .001 ? (int)(wait * 1e6) : 1000);
+    }
+
+    return WAIT_TIME;
+  }
+
+  template <typename instance_t>
+  worker_pool<instance_t>::worker_pool(): running(false), next_queue(0), wakeups(0) {}
+
+  template <typename instance_t>
+  void worker_pool<instance_t>::add(instance* inst) {
+    assert(!running);
+    instances.push_back(inst);
+    on_key(inst->runtime, [this, inst]() { wake(inst); });
+  }
+
+  template <typename instance_t>
+  void worker_pool<instance_t>::start(int threads) {
+    if(threads < 1) threads = 1;
+    if(threads > (int)instances.size()) threads = instances.size();
+
+    for(int i = 0; i < threads; i++) {
+      queues.push_back(std::unique_ptr<run_queue>(new run_queue));
+    }
+
+    for(size_t i = 0; i < instances.size(); i++) {
+      queues[i % threads]->q.push_back(instances[i]);
+    }
+
+    running = true;
+    for(int i = 0; i < threads; i++) {
+      workers.push_back(std::thread(&worker_pool::work, this, i));
+    }
+  }
+
+  template <typename instance_t>
+  void worker_pool<instance_t>::stop() {
+    {
+      std::lock_guard<std::mutex> lock(sleep_mutex);
+      running = false;
+    }
+    sleep_cv.notify_all();
+
+    for(auto& t: workers) {
+      t.join();
+    }
+    workers.clear();
+    queues.clear();
+  }
+
+  template <typename instance_t>
+  void worker_pool<instance_t>::push(int id, instance* inst) {
+    run_queue& rq = *queues[id];
+    std::lock_guard<std::mutex> lock(rq.m);
+    rq.q.push_back(inst);
+  }
+
+  template <typename instance_t>
+  void worker_pool<instance_t>::requeue(int id, instance* inst) {
+    run_queue& rq = *queues[id];
+    std::lock_guard<std::mutex> lock(rq.m);
+    rq.q.push_front(inst);
+  }
+
+  template <typename instance_t>
+  typename worker_pool<instance_t>::instance* worker_pool<instance_t>::take(int id) {
+    {
+      run_queue& rq = *queues[id];
+      std::lock_guard<std::mutex> lock(rq.m);
+      if(!rq.q.empty()) {
+        instance* ret = rq.q.back();
+        rq.q.pop_back();
+        return ret;
+      }
+    }
+
+    for(size_t i = 1; i < queues.size(); i++) {
+      run_queue& rq = *queues[(id + i) % queues.size()];
+      std::lock_guard<std::mutex> lock(rq.m);
+      if(!rq.q.empty()) {
+        instance* ret = rq.q.front();
+        rq.q.pop_front();
+        return ret;
+      }
+    }
+
+    return 0;
+  }
+
+  template <typename instance_t>
+  void worker_pool<instance_t>::sleep_until(instance* inst, clock::time_point t) {
+    bool earliest;
+    {
+      std::lock_guard<std::mutex> lock(sleep_mutex);
+      earliest = sleeping.empty() || t < sleeping.top().first;
+      sleeping.push(timed(t, inst));
+    }
+
+    if(earliest) sleep_cv.notify_one();
+  }
+
+  template <typename instance_t>
+  void worker_pool<instance_t>::wake(instance* inst) {
+    if(!inst->parked.exchange(false)) return;
+
+    push(next_queue++ % queues.size(), inst);
+    {
+      std::lock_guard<std::mutex> lock(sleep_mutex);
+      wakeups++;
+    }
+    sleep_cv.notify_one();
+  }
+
+  template <typename instance_t>
+  void worker_pool<instance_t>::work(int id) {
+    while(running) {
+      uint64_t seen = wakeups;
+      instance* inst = take(id);
+
+      if(!inst) {
+        std::unique_lock<std::mutex> lock(sleep_mutex);
+        if(!running) break;
+
+        // something was pushed after we looked
+        if(wakeups != seen) continue;
+
+        clock::time_point now = clock::now();
+        if(!sleeping.empty() && sleeping.top().first <= now) {
+          inst = sleeping.top().second;
+          sleeping.pop();
+        }
+        else {
+          // woken early by a key, a new earliest sleeper, or stop
+          clock::time_point until = sleeping.empty() ?
+            now + std::chrono::milliseconds(10) : sleeping.top().first;
+          sleep_cv.wait_until(lock, until);
+          continue;
+        }
+      }
+
+      int state = inst->step(clock::now());
+
+      if(state == instance::RUNNABLE) {
+        requeue(id, inst);
+      }
+      else if(state == instance::WAIT_TIME) {
+        sleep_until(inst, inst->wake_at);
+      }
+      else if(state == instance::WAIT_KEY) {
+        inst->parked = true;
+
+        // the key may have arrived before we parked
+        if(key_pending(inst->runtime)) wake(inst);
+      }
+      // a halted instance is just dropped. it was never parked, so wake()
+      // leaves it alone
+    }
+  }
+
+  template <typename instance_t>
+  worker_pool<instance_t>::~worker_pool() {
+    if(running) stop();
+  }
+
+  template struct basic_instance<sdl_runtime<dram> >;
+  template struct basic_instance<headless_runtime<dram> >;
+  template struct worker_pool<instance>;
+  template struct worker_pool<headless_instance>;
+}
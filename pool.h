@@ -0,0 +1,131 @@
+#ifndef __POOL_H__
+#define __POOL_H__
+
+#include "core.h"
+#include "sdl.h"
+#include "trace.h"
+#include "capture.h"
+#include "shm.h"
+
+#include <vector>
+#include <deque>
+#include <queue>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <memory>
+#include <utility>
+
+namespace chip8 {
+  // a single emulated machine, drawing into its own view of a shared window
+  // or, with a headless runtime, only into its framebuffer.
+  // everything but the shared rom image, the memory pages past the inline
+  // ones and the postfx scratch buffers, which grow with the upscale factor,
+  // lives in one cache line aligned block
+  template <typename runtime_t>
+  struct alignas(64) basic_instance: aligned_new<basic_instance<runtime_t> > {
+    typedef std::chrono::steady_clock clock;
+
+    // why step returned
+    enum {
+          RUNNABLE, // ran out of budget, resume as soon as possible
+          WAIT_KEY, // blocked on Fx0A, resume when a key arrives
+          WAIT_TIME, // nothing to do until wake_at
+          HALTED // faulted, never runs again
+    };
+
+    static const int BUDGET = 1000; // max instructions per step
+
+    cpu core;
+    dram ram;
+    runtime_t runtime;
+
+    int ips; // instructions per second
+    clock::time_point last;
+    clock::time_point wake_at;
+    double instr_acc; // instructions owed since the last step
+    double timer_acc; // timer ticks owed since the last step
+
+    std::atomic<bool> parked; // not in any run queue, owned by whoever unparks it
+    std::atomic<bool> halted; // faulted under the trap memory policy, never runs again
+
+    std::unique_ptr<trace_writer> trace;
+    std::unique_ptr<frame_capture> capture;
+    std::unique_ptr<shm_publisher> shm;
+    uint64_t ticks; // timer ticks since start, the capture clock
+
+    // whatever follows the seed goes to the runtime, after the memory
+    template <typename... args>
+    basic_instance(int ips, uint64_t seed, args&&... a)
+      : core(dram::ROM_START), runtime(&ram, std::forward<args>(a)...), ips(ips),
+        last(clock::now()), instr_acc(0), timer_acc(0), parked(false), halted(false), ticks(0) {
+      runtime.seed(seed);
+      runtime.clear();
+    }
+
+    bool load(const char* rom_path);
+    void load(std::shared_ptr<const dram_image> image);
+    bool start_trace(const char* path);
+    bool start_capture(const char* path);
+    bool start_shm(const char* name);
+    void set_quirks(const quirks& q);
+
+    // run the instructions that have come due since the last call, until
+    // the instance has to wait for something
+    int step(clock::time_point now);
+  };
+
+  typedef basic_instance<sdl_runtime<dram> > instance;
+  typedef basic_instance<headless_runtime<dram> > headless_instance;
+
+  // runs a set of instances as resumable tasks on a small number of threads,
+  // idle instances sit in no queue and cost nothing until they are woken.
+  // each worker owns a deque, taking from the back of its own and stealing
+  // from the front of the others when it runs dry. woken instances go on the
+  // back so they run next, ones that used up their budget go on the front so
+  // the rest of the deque gets a turn first
+  template <typename instance_t>
+  struct worker_pool {
+    typedef std::chrono::steady_clock clock;
+    typedef instance_t instance;
+    typedef std::pair<clock::time_point, instance*> timed;
+
+    struct run_queue {
+      std::mutex m;
+      std::deque<instance*> q;
+    };
+
+    std::vector<instance*> instances;
+    std::vector<std::unique_ptr<run_queue> > queues;
+    std::vector<std::thread> workers;
+    std::atomic<bool> running;
+    std::atomic<unsigned> next_queue;
+
+    // instances waiting on the clock, and idle workers waiting on anything
+    std::mutex sleep_mutex;
+    std::condition_variable sleep_cv;
+    std::priority_queue<timed, std::vector<timed>, std::greater<timed> > sleeping;
+    std::atomic<uint64_t> wakeups; // bumped under sleep_mutex, so idle workers can't miss a wake
+
+    worker_pool();
+
+    void add(instance* inst);
+
+    void start(int threads = std::thread::hardware_concurrency());
+    void stop();
+
+    void push(int id, instance* inst);
+    void requeue(int id, instance* inst);
+    instance* take(int id);
+    void sleep_until(instance* inst, clock::time_point t);
+    void wake(instance* inst);
+
+    void work(int id);
+
+    ~worker_pool();
+  };
+}
+
+#endif //__POOL_H__
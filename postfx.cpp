@@ -0,0 +1,160 @@
+#include "postfx.h"
+
+#include <cstring>
+#include <chrono>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+namespace chip8 {
+  // BGRA8888 channels
+  static const uint32_t ALPHA = 0x000000FF;
+  static const uint32_t CHANNELS[3] = {0x0000FF00, 0x00FF0000, 0xFF000000};
+
+  // writes each of the n source pixels s times
+  static void expand(const uint8_t* src, int n, int s, const uint32_t* palette, uint32_t* out) {
+    for(int i = 0; i < n; i++) {
+      uint32_t c = palette[src[i]];
+      int k = 0;
+#ifdef __SSE2__
+      __m128i v = _mm_set1_epi32(c);
+      for(; k + 4 <= s; k += 4) _mm_storeu_si128((__m128i*)(out + k), v);
+#endif
+      for(; k < s; k++) out[k] = c;
+      out += s;
+    }
+  }
+
+  // keeps the channels set in keep and halves the others
+  static void apply_mask(const uint32_t* in, const uint32_t* keep, uint32_t* out, int n) {
+    int i = 0;
+#ifdef __SSE2__
+    const __m128i low = _mm_set1_epi32(0x7F7F7F7F);
+    for(; i + 4 <= n; i += 4) {
+      __m128i v = _mm_loadu_si128((const __m128i*)(in + i));
+      __m128i k = _mm_loadu_si128((const __m128i*)(keep + i));
+      __m128i half = _mm_and_si128(_mm_srli_epi32(v, 1), low);
+      _mm_storeu_si128((__m128i*)(out + i), _mm_or_si128(_mm_and_si128(v, k), _mm_andnot_si128(k, half)));
+    }
+#endif
+    for(; i < n; i++) {
+      out[i] = (in[i] & keep[i]) | ((in[i] >> 1) & 0x7F7F7F7F & ~keep[i]);
+    }
+  }
+
+  // scale2x: each pixel becomes 4, taking the color of two equal
+  // neighbors on a corner so diagonal edges don't turn into steps
+  static void scale_epx(const uint8_t* src, int w, int h, uint8_t* out) {
+    for(int y = 0; y < h; y++) {
+      const uint8_t* row = src + y * w;
+      const uint8_t* up = y ? row - w : row;
+      const uint8_t* down = y + 1 < h ? row + w : row;
+      uint8_t* o = out + y * 2 * w * 2;
+
+      for(int x = 0; x < w; x++) {
+        uint8_t p = row[x];
+        uint8_t a = up[x], d = down[x];
+        uint8_t c = row[x ? x - 1 : x], b = row[x + 1 < w ? x + 1 : x];
+
+        o[2 * x] = c == a && c != d && a != b ? a : p;
+        o[2 * x + 1] = a == b && a != c && b != d ? b : p;
+        o[2 * w + 2 * x] = d == c && d != b && c != a ? c : p;
+        o[2 * w + 2 * x + 1] = b == d && b != a && d != c ? d : p;
+      }
+    }
+  }
+
+  postfx::postfx(int src_w, int src_h, int scale, int filter, int mask, int budget_us)
+    : src_w(src_w), src_h(src_h), scale(scale < 1 ? 1 : scale), filter(filter), mask(mask),
+      budget_us(budget_us), level(2), fast_frames(0) {
+    if(filter == EPX) {
+      if(this->scale < 2) this->filter = NEAREST;
+      else this->scale &= ~1;
+    }
+
+    for(int i = 0; i < 256; i++) {
+      palette[i] = ALPHA | i << 8 | i << 16 | (uint32_t)i << 24;
+    }
+
+    int w = width();
+    int epx_size = this->filter == EPX ? src_w * 2 * src_h * 2 : 0;
+    arena.resize(BUFFERS * w + (epx_size + 3) / 4);
+
+    uint32_t* lit = buffer(LIT);
+    uint32_t* dark = buffer(DARK);
+    for(int x = 0; x < w; x++) {
+      lit[x] = mask == CRT ? ALPHA | CHANNELS[x % 3] : 0xFFFFFFFF;
+      dark[x] = ALPHA;
+    }
+  }
+
+  int postfx::width() {
+    return src_w * scale;
+  }
+
+  int postfx::height() {
+    return src_h * scale;
+  }
+
+  void postfx::render(const uint8_t* src, int w, int h, int cell, int mask,
+                      uint32_t* dst, int stride) {
+    int n = w * cell;
+    int dark_rows = mask != NONE && cell >= 2 ? (cell / 3 ? cell / 3 : 1) : 0;
+    int lit_rows = cell - dark_rows;
+
+    // rows are written from the scratch buffers, never read back from the
+    // texture, which may be slow to read
+    uint32_t* row = buffer(ROW);
+    uint32_t* lit_row = buffer(LIT_ROW);
+    uint32_t* dark_row = buffer(DARK_ROW);
+    const uint32_t* bright = mask == CRT ? lit_row : row;
+    for(int y = 0; y < h; y++) {
+      expand(src + y * w, w, cell, palette, row);
+      if(mask == CRT) apply_mask(row, buffer(LIT), lit_row, n);
+      if(dark_rows) apply_mask(row, buffer(DARK), dark_row, n);
+
+      uint32_t* d = dst + y * cell * stride;
+      for(int r = 0; r < lit_rows; r++, d += stride) memcpy(d, bright, n * sizeof(uint32_t));
+      for(int r = 0; r < dark_rows; r++, d += stride) memcpy(d, dark_row, n * sizeof(uint32_t));
+    }
+  }
+
+  void postfx::process(const uint8_t* src, uint32_t* dst, int stride) {
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+    int m = level >= 2 ? mask : NONE;
+    if(level >= 1 && filter == EPX) {
+      scale_epx(src, src_w, src_h, epx());
+      render(epx(), src_w * 2, src_h * 2, scale / 2, m, dst, stride);
+    }
+    else {
+      render(src, src_w, src_h, scale, m, dst, stride);
+    }
+
+    int us = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count();
+    if(us > budget_us) {
+      if(level) level--;
+      fast_frames = 0;
+    }
+    else if(level < 2 && us < budget_us / 2 && ++fast_frames >= 120) {
+      level++;
+      fast_frames = 0;
+    }
+  }
+
+  bool ghost(const uint64_t* rows, int w, int h, int decay, uint8_t* level) {
+    uint8_t fading = 0;
+    for(int y = 0; y < h; y++) {
+      uint64_t bits = rows[y];
+      uint8_t* l = level + y * w;
+      for(int x = 0; x < w; x++) {
+        uint8_t on = (bits >> (w - 1 - x)) & 1;
+        uint8_t v = on ? 255 : l[x] * decay >> 8;
+        fading |= on ? 0 : v;
+        l[x] = v;
+      }
+    }
+    return fading;
+  }
+}
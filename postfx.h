@@ -0,0 +1,54 @@
+#ifndef __POSTFX_H__
+#define __POSTFX_H__
+
+#include <cstdint>
+#include <vector>
+
+namespace chip8 {
+  // turns the per pixel phosphor intensities of the chip8 screen into
+  // BGRA8888 texture rows at an integer scale, so the renderer only has to
+  // copy them. each output row is built once per source row by the row
+  // kernels and then copied down, which keeps 4K output within a frame
+  struct postfx {
+    enum { NEAREST, EPX }; // upscaling filters, EPX needs an even scale
+    enum { NONE, SCANLINES, CRT }; // masks, need at least 2 rows per pixel
+
+    int src_w, src_h;
+    int scale;
+    int filter;
+    int mask;
+
+    // when a frame takes longer than the budget the mask and then the
+    // filter are dropped, and brought back once frames are comfortably fast
+    int budget_us;
+    int level; // 2 everything, 1 no mask, 0 nearest only
+    int fast_frames;
+
+    uint32_t palette[256]; // intensity to pixel
+
+    // every scratch buffer in one allocation, width() pixels each: the
+    // current source row scaled, the same with the masks applied, and the
+    // per column masks (set bits are kept). then the source scaled 2x by EPX
+    enum { ROW, LIT_ROW, DARK_ROW, LIT, DARK, BUFFERS };
+    std::vector<uint32_t> arena;
+
+    postfx(int src_w = 64, int src_h = 32, int scale = 1,
+           int filter = NEAREST, int mask = NONE, int budget_us = 4000);
+
+    int width();
+    int height();
+
+    uint32_t* buffer(int which) { return arena.data() + which * width(); }
+    uint8_t* epx() { return (uint8_t*)buffer(BUFFERS); }
+
+    void process(const uint8_t* src, uint32_t* dst, int stride);
+    void render(const uint8_t* src, int w, int h, int cell, int mask,
+                uint32_t* dst, int stride);
+  };
+
+  // fades unlit pixels by decay/256 and lights the set ones, returns true
+  // if anything is still fading
+  bool ghost(const uint64_t* rows, int w, int h, int decay, uint8_t* level);
+}
+
+#endif //__POSTFX_H__
@@ -45,14 +45,10 @@ namespace chip8 {
   }
 
   void render_window::init_sdl() {
-    static bool init = false;
+    static std::once_flag init;
 
-    if(!init) {
-      init = true;
-
-      // TODO: we don't really need everything
-      SDL_Init(SDL_INIT_EVERYTHING);
-    }
+    // video brings up events too, nothing else is used
+    std::call_once(init, []() { SDL_Init(SDL_INIT_VIDEO); });
   }
 
   SDL_Rect render_window::null_rect() {
@@ -74,7 +70,7 @@ namespace chip8 {
                 int h,
                 const char* title,
                 uint32_t flags)
-    : w(w), h(h) {
+    : w(w), h(h), focus(0), next_listener(0) {
     init_sdl();
 
     flags |= SDL_WINDOW_SHOWN;
@@ -87,22 +83,49 @@ namespace chip8 {
     renderer = SDL_CreateRenderer(window, -1, 0);
   }
 
-  void render_window::register_listener(std::function<void(int)> l) {
-    listeners.push_back(l);
+  int render_window::register_listener(std::function<void(int)> l) {
+    std::lock_guard<std::mutex> lock(listener_mutex);
+    listeners[next_listener] = l;
+    return next_listener++;
+  }
+
+  void render_window::unregister_listener(int id) {
+    std::lock_guard<std::mutex> lock(listener_mutex);
+    listeners.erase(id);
   }
 
   void render_window::key_update(int keycode, bool down) {
-    key_status[keycode] = down;
+    {
+      std::lock_guard<std::mutex> lock(key_mutex);
+      key_status[keycode] = down;
+    }
 
     if(down) {
-      for(auto f: listeners) {
-        f(keycode);
+      std::lock_guard<std::mutex> lock(listener_mutex);
+      for(auto& l: listeners) {
+        l.second(keycode);
       }
     }
   }
 
   bool render_window::get_key(int keycode) {
-    return key_status[keycode];
+    std::lock_guard<std::mutex> lock(key_mutex);
+    auto it = key_status.find(keycode);
+    return it != key_status.end() && it->second;
+  }
+
+  bool render_window::focused(view* v) {
+    return focus == v;
+  }
+
+  void render_window::click(int x, int y) {
+    for(auto& v: views) {
+      if(x >= v->dest.x && x < v->dest.x + v->dest.w &&
+         y >= v->dest.y && y < v->dest.y + v->dest.h) {
+        focus = v.get();
+        return;
+      }
+    }
   }
 
   render_window::view* render_window::add_view(SDL_Rect dest, uint32_t pixel_format) {
@@ -114,10 +137,12 @@ namespace chip8 {
 
     view* ret = new view(this, dest, pixel_format);
     views.push_back(std::shared_ptr<view>(ret));
+    if(!focus) focus = ret;
     return ret;
   }
 
   bool render_window::update(bool redraw) {
+    metrics::scope timed(stats.render_update);
     bool ret = true;
 
     // handle events
@@ -130,6 +155,9 @@ namespace chip8 {
       case SDL_KEYUP:
         key_update(e.key.keysym.sym, false);
         break;
+      case SDL_MOUSEBUTTONDOWN:
+        click(e.button.x, e.button.y);
+        break;
       case SDL_QUIT:
         ret = false;
       }
@@ -140,7 +168,18 @@ namespace chip8 {
         v->render();
       }
 
-      SDL_RenderPresent(renderer);
+      // outline the focused view when there is more than one to choose from
+      view* f = focus;
+      if(f && views.size() > 1) {
+        SDL_SetRenderDrawColor(renderer, 0xFF, 0x80, 0, 0xFF);
+        SDL_RenderDrawRect(renderer, &f->dest);
+      }
+
+      {
+        metrics::scope timed(stats.present);
+        SDL_RenderPresent(renderer);
+      }
+      stats.frames.add();
     }
 
     return ret;
@@ -151,91 +190,130 @@ namespace chip8 {
     SDL_DestroyWindow(window);
   }
 
+  metrics_overlay::metrics_overlay(render_window* win)
+    : last(metrics::clock::now()), last_instructions(0), last_frames(0) {
+    stats.enabled = true;
+    memset(last_buckets, 0, sizeof(last_buckets));
+
+    view = win->add_view(render_window::create_rect(0, 0, W, H));
+    view->scale(W * SCALE, H * SCALE);
+    show(0, 0, 0);
+  }
+
+  void metrics_overlay::print(uint32_t* p, int stride, int row, uint64_t val) {
+    char buf[32];
+    int n = snprintf(buf, sizeof(buf), "%llu", (unsigned long long)val);
+    if(n > W / 5) n = W / 5;
+
+    for(int c = 0; c < n; c++) {
+      const uint8_t* glyph = font + (buf[c] - '0') * 5;
+      for(int i = 0; i < 5; i++) {
+        for(int j = 0; j < 4; j++) {
+          if(glyph[i] & (0x80 >> j))
+            p[(row * 6 + 1 + i) * stride + c * 5 + 1 + j] = 0x00FF00FF;
+        }
+      }
+    }
+  }
+
+  void metrics_overlay::show(uint64_t ips, uint64_t fps, uint64_t worst_us) {
+    uint32_t* p = (uint32_t*)view->lock();
+    int stride = view->pitch() / sizeof(uint32_t);
+    for(int i = 0; i < H; i++) {
+      for(int j = 0; j < W; j++) {
+        p[i * stride + j] = 0xFF;
+      }
+    }
+
+    print(p, stride, 0, ips);
+    print(p, stride, 1, fps);
+    print(p, stride, 2, worst_us);
+    view->unlock();
+  }
+
+  void metrics_overlay::update() {
+    metrics::clock::time_point now = metrics::clock::now();
+    double elapsed = std::chrono::duration<double>(now - last).count();
+    if(elapsed < .5) return;
+
+    uint64_t instructions = stats.instructions.value();
+    uint64_t frames = stats.frames.value();
+
+    uint64_t buckets[metrics::BUCKETS], sum, count;
+    stats.render_update.snapshot(buckets, sum, count);
+
+    // the highest bucket that got a sample since the last update
+    uint64_t worst = 0;
+    for(int j = 0; j < metrics::BUCKETS; j++) {
+      if(buckets[j] != last_buckets[j]) worst = 256ull << j;
+      last_buckets[j] = buckets[j];
+    }
+
+    show((instructions - last_instructions) / elapsed,
+         (frames - last_frames) / elapsed,
+         worst / 1000);
+
+    last = now;
+    last_instructions = instructions;
+    last_frames = frames;
+  }
+
   template<typename addressable_t> const double sdl_runtime<addressable_t>::decay_ratio = .8;
   template<typename addressable_t> const int sdl_runtime<addressable_t>::digit_base = 0;
 
-  template<typename addressable_t>
-  const uint8_t sdl_runtime<addressable_t>::digits[0x50] = {
-                                                            0xF0, 0x90, 0x90, 0x90, 0xF0,
-                                                            0x20, 0x60, 0x20, 0x20, 0x70,
-                                                            0xF0, 0x10, 0xF0, 0x80, 0xF0,
-                                                            0xF0, 0x10, 0xF0, 0x10, 0xF0,
-                                                            0x90, 0x90, 0xF0, 0x10, 0x10,
-                                                            0xF0, 0x80, 0xF0, 0x10, 0xF0,
-                                                            0xF0, 0x80, 0xF0, 0x90, 0xF0,
-                                                            0xF0, 0x10, 0x20, 0x40, 0x40,
-                                                            0xF0, 0x90, 0xF0, 0x90, 0xF0,
-                                                            0xF0, 0x90, 0xF0, 0x10, 0xF0,
-                                                            0xF0, 0x90, 0xF0, 0x90, 0x90,
-                                                            0xE0, 0x90, 0xE0, 0x90, 0xE0,
-                                                            0xF0, 0x80, 0x80, 0x80, 0xF0,
-                                                            0xE0, 0x90, 0x90, 0x90, 0xE0,
-                                                            0xF0, 0x80, 0xF0, 0x80, 0xF0,
-                                                            0xF0, 0x80, 0xF0, 0x80, 0x80
-  };
-
   template <typename addressable_t>
   sdl_runtime<addressable_t>::sdl_runtime(addressable_t* mem,
-                                          render_window::view* view)
-    : mem(mem), view(view), pixels(W * H, 0), with_decay(W * H, 0), last(-1) {
-    mem->write(digit_base, digits, 0x50);
-    view->parent->register_listener(std::bind(&sdl_runtime::set_last_key, this, std::placeholders::_1));
+                                          render_window::view* view,
+                                          const postfx& fx)
+    : mem(mem), view(view), fx(fx),
+      dirty(true), fading(false), last(-1), waiting(false) {
+    memset(with_decay, 0, sizeof(with_decay));
+    mem->write(digit_base, font, 0x50);
+    listener = view->parent->register_listener(std::bind(&sdl_runtime::set_last_key, this, std::placeholders::_1));
   }
 
   template <typename addressable_t>
-  constexpr uint32_t sdl_runtime<addressable_t>::get_pixel(uint8_t val) {
-    uint32_t ret = 0xFF;
-    ret |= val << 8;
-    ret |= val << 16;
-    ret |= val << 24;
-    return ret;
+  sdl_runtime<addressable_t>::~sdl_runtime() {
+    view->parent->unregister_listener(listener);
   }
 
   template <typename addressable_t>
   void sdl_runtime<addressable_t>::clear() {
-    for(int i = 0; i < H; i++) {
-      for(int j = 0; j < W; j++) {
-        pixels[i * W + j] = 0;
-      }
-    }
+    std::lock_guard<std::mutex> lock(frame_mutex);
+    dirty = true;
+    fb.clear();
   }
 
   template <typename addressable_t>
-  void sdl_runtime<addressable_t>::update(double elapsed_ms) {
-    double adj_decay = pow(decay_ratio, elapsed_ms);
+  bool sdl_runtime<addressable_t>::update(double elapsed_ms) {
+    // nothing new to show, and nothing left to fade out
+    if(!dirty.exchange(false) && !fading) return false;
 
-    uint32_t* p = (uint32_t*)view->lock();
-    int stride = view->pitch() / sizeof(uint32_t);
-    for(int i = 0; i < H; i++) {
-      for(int j = 0; j < W; j++) {
-        with_decay[i * W + j] = pixels[i * W + j] ? 255 :
-          with_decay[i * W + j] * adj_decay;
+    metrics::scope timed(stats.runtime_update);
+    int decay = pow(decay_ratio, elapsed_ms) * 256;
 
-        p[i * stride + j] = get_pixel(with_decay[i * W + j]);
-      }
+    {
+      std::lock_guard<std::mutex> lock(frame_mutex);
+      fading = ghost(fb.rows, W, H, decay, with_decay);
     }
+
+    uint32_t* p = (uint32_t*)view->lock();
+    fx.process(with_decay, p, view->pitch() / sizeof(uint32_t));
     view->unlock();
+    return true;
   }
 
   template <typename addressable_t>
   bool sdl_runtime<addressable_t>::draw(int addr, int n, int x, int y) {
-    int stride = view->pitch() / sizeof(uint32_t);
+    metrics::scope timed(stats.draw);
+    std::lock_guard<std::mutex> lock(frame_mutex);
+    dirty = true;
 
-    bool ret = false;
+    uint8_t sprite[16];
     for(int i = 0; i < n; i++) {
-      auto sprite = std::bitset<8>(mem->get(addr + i));
-      for(int j = 0; j < 8; j++) {
-        int X = (j + x) % W;
-        int Y = (i + y) % H;
-        bool existing = pixels[Y * W + X];
-        bool to_add = sprite[7 - j];
-
-        if(existing && to_add)
-          ret = true;
-
-        pixels[Y * W + X] = existing ^ to_add;
-      }
+      sprite[i] = mem->get(addr + i);
     }
+    bool ret = fb.draw(sprite, n, x, y);
 
     D {
       std::cout << "drawn: " << std::endl;
@@ -302,18 +380,26 @@ namespace chip8 {
 
   template <typename addressable_t>
   bool sdl_runtime<addressable_t>::get_key(int key) {
+    if(!view->parent->focused(view)) return false;
     return view->parent->get_key(to_keycode(key));
   }
 
   template <typename addressable_t>
   void sdl_runtime<addressable_t>::set_last_key(int key) {
+    if(!view->parent->focused(view)) return;
     last = from_keycode(key);
+    if(last != -1 && on_key) on_key();
   }
 
   template <typename addressable_t>
   int sdl_runtime<addressable_t>::wait_key() {
-    last = -1;
-    while(last == -1);
+    if(!waiting) {
+      last = -1;
+      waiting = true;
+    }
+
+    if(last == -1) return -1;
+    waiting = false;
     return last;
   }
 
@@ -1,13 +1,20 @@
+#ifndef __SDL_H__
+#define __SDL_H__
+
 #include "core.h"
+#include "metrics.h"
+#include "postfx.h"
 
 #include "SDL2/SDL.h"
 
 #include <vector>
 #include <memory>
 #include <unordered_map>
+#include <map>
 #include <bitset>
 #include <functional>
 #include <atomic>
+#include <mutex>
 
 namespace chip8 {
   struct render_window {
@@ -43,16 +50,25 @@ namespace chip8 {
     };
 
     std::vector<std::shared_ptr<view> > views;
+    std::atomic<view*> focus; // the view that receives keyboard input
 
+    std::mutex key_mutex;
     std::unordered_map<int, bool> key_status;
-    std::vector<std::function<void(int)>> listeners;
+
+    std::mutex listener_mutex;
+    std::map<int, std::function<void(int)> > listeners;
+    int next_listener;
 
     render_window(int w, int h, const char* title = "CHIP8", uint32_t flags = 0);
 
-    void register_listener(std::function<void(int)> l);
+    int register_listener(std::function<void(int)> l); // returns an id for unregister_listener
+    void unregister_listener(int id);
     void key_update(int keycode, bool down);
     bool get_key(int keycode);
 
+    bool focused(view* v);
+    void click(int x, int y);
+
     view* add_view(SDL_Rect dest = null_rect(), uint32_t pixel_format = SDL_PIXELFORMAT_BGRA8888);
 
     bool update(bool redraw = true);
@@ -60,6 +76,27 @@ namespace chip8 {
     ~render_window();
   };
 
+  // shows live metrics in a corner of the window using the chip8 font,
+  // one number per row: instructions per second, frames per second and
+  // the worst render_window::update time in the last interval (in us)
+  struct metrics_overlay {
+    static const int W = 48;
+    static const int H = 18;
+    static const int SCALE = 3;
+
+    render_window::view* view;
+
+    metrics::clock::time_point last;
+    uint64_t last_instructions, last_frames;
+    uint64_t last_buckets[metrics::BUCKETS];
+
+    metrics_overlay(render_window* win);
+
+    void print(uint32_t* p, int stride, int row, uint64_t val);
+    void show(uint64_t ips, uint64_t fps, uint64_t worst_us);
+    void update();
+  };
+
   template <typename addressable_t>
   struct sdl_runtime: debug_runtime {
     addressable_t* mem;
@@ -68,24 +105,29 @@ namespace chip8 {
     static const int W = 64;
     static const int H = 32;
 
-    std::vector<bool> pixels;
-    std::vector<uint8_t> with_decay;
+    std::mutex frame_mutex;
+    framebuffer fb;
+    uint8_t with_decay[W * H];
+    postfx fx; // the view's texture has to be fx.width() x fx.height()
+    std::atomic<bool> dirty; // fb changed since the last update
+    bool fading; // some pixels are still decaying
 
     static const double decay_ratio;
 
-    static const uint8_t digits[0x50];
-
     static const int digit_base;
     std::atomic<int> last;
+    bool waiting;
+    std::function<void()> on_key; // called from the event thread when a key arrives
 
-    sdl_runtime(addressable_t* mem, render_window::view* view);
+    int listener;
 
-    constexpr uint32_t get_pixel(uint8_t val);
+    sdl_runtime(addressable_t* mem, render_window::view* view, const postfx& fx = postfx());
+    ~sdl_runtime();
 
     void clear();
     bool draw(int addr, int n, int x, int y);
 
-    void update(double elapsed_ms);
+    bool update(double elapsed_ms); // returns true if the view was redrawn
 
     int digit_sprite(int digit);
 
@@ -97,3 +139,5 @@ namespace chip8 {
   };
 
 }
+
+#endif //__SDL_H__
@@ -0,0 +1,150 @@
+#include "shm.h"
+
+#include <atomic>
+#include <cstring>
+#include <cstdlib>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+namespace chip8 {
+  static const uint32_t SHM_MAGIC = 0x42463843; // "C8FB"
+  static const uint32_t SHM_VERSION = 1;
+
+  // everything the reader copies is a relaxed atomic, ordered by the fences
+  // around seq, so a torn read is caught by the sequence check rather than
+  // being a data race
+  struct shm_segment {
+    std::atomic<uint32_t> magic; // written last, once the segment is set up
+    uint32_t version;
+    std::atomic<uint32_t> seq; // odd while the publisher is writing
+    uint32_t reserved;
+    std::atomic<uint64_t> frame;
+    std::atomic<uint64_t> rows[32];
+    std::atomic<uint64_t> v[2]; // V0-V15, V0 in the low byte of v[0]
+    std::atomic<uint64_t> regs; // pc | I << 16 | sp << 32 | dt << 40 | st << 48
+  };
+
+  static_assert(sizeof(std::atomic<uint64_t>) == 8, "shared layout needs plain 8 byte atomics");
+
+  shm_publisher::shm_publisher(const char* name): name(name), seg(0) {
+    int fd = shm_open(name, O_CREAT | O_RDWR, 0644);
+    if(fd < 0) return;
+
+    if(ftruncate(fd, sizeof(shm_segment)) == 0) {
+      void* p = mmap(0, sizeof(shm_segment), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+      if(p != MAP_FAILED) seg = (shm_segment*)p;
+    }
+    close(fd);
+    if(!seg) return;
+
+    seg->magic.store(0, std::memory_order_relaxed);
+    seg->version = SHM_VERSION;
+    seg->seq.store(0, std::memory_order_relaxed);
+    seg->frame.store(0, std::memory_order_relaxed);
+    seg->magic.store(SHM_MAGIC, std::memory_order_release);
+  }
+
+  bool shm_publisher::ok() {
+    return seg != 0;
+  }
+
+  void shm_publisher::publish(const uint64_t* rows, const uint8_t* v, uint16_t pc, uint16_t I,
+                              uint8_t sp, uint8_t dt, uint8_t st) {
+    uint32_t s = seg->seq.load(std::memory_order_relaxed);
+    seg->seq.store(s + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+
+    for(int i = 0; i < 32; i++) seg->rows[i].store(rows[i], std::memory_order_relaxed);
+
+    uint64_t lo, hi;
+    memcpy(&lo, v, 8);
+    memcpy(&hi, v + 8, 8);
+    seg->v[0].store(lo, std::memory_order_relaxed);
+    seg->v[1].store(hi, std::memory_order_relaxed);
+    seg->regs.store(pc | (uint64_t)I << 16 | (uint64_t)sp << 32 | (uint64_t)dt << 40 | (uint64_t)st << 48,
+                    std::memory_order_relaxed);
+    seg->frame.store(seg->frame.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+
+    seg->seq.store(s + 2, std::memory_order_release);
+  }
+
+  shm_publisher::~shm_publisher() {
+    if(!seg) return;
+    munmap(seg, sizeof(shm_segment));
+    shm_unlink(name.c_str());
+  }
+}
+
+using chip8::shm_segment;
+
+struct chip8_shm {
+  const shm_segment* seg;
+};
+
+extern "C" {
+
+chip8_shm* chip8_shm_open(const char* name) {
+  int fd = shm_open(name, O_RDONLY, 0);
+  if(fd < 0) return 0;
+
+  struct stat st;
+  void* p = MAP_FAILED;
+  if(fstat(fd, &st) == 0 && st.st_size >= (off_t)sizeof(shm_segment)) {
+    p = mmap(0, sizeof(shm_segment), PROT_READ, MAP_SHARED, fd, 0);
+  }
+  close(fd);
+  if(p == MAP_FAILED) return 0;
+
+  const shm_segment* seg = (const shm_segment*)p;
+  if(seg->magic.load(std::memory_order_acquire) != chip8::SHM_MAGIC || seg->version != chip8::SHM_VERSION) {
+    munmap(p, sizeof(shm_segment));
+    return 0;
+  }
+
+  chip8_shm* ret = new chip8_shm;
+  ret->seg = seg;
+  return ret;
+}
+
+void chip8_shm_close(chip8_shm* s) {
+  munmap((void*)s->seg, sizeof(shm_segment));
+  delete s;
+}
+
+uint64_t chip8_shm_frame_count(chip8_shm* s) {
+  return s->seg->frame.load(std::memory_order_acquire);
+}
+
+int chip8_shm_read(chip8_shm* s, chip8_shm_frame* out) {
+  const shm_segment* seg = s->seg;
+
+  for(int attempt = 0; attempt < 1000; attempt++) {
+    uint32_t before = seg->seq.load(std::memory_order_acquire);
+    if(before & 1) continue;
+
+    out->frame = seg->frame.load(std::memory_order_relaxed);
+    for(int i = 0; i < 32; i++) out->rows[i] = seg->rows[i].load(std::memory_order_relaxed);
+    uint64_t lo = seg->v[0].load(std::memory_order_relaxed);
+    uint64_t hi = seg->v[1].load(std::memory_order_relaxed);
+    uint64_t regs = seg->regs.load(std::memory_order_relaxed);
+
+    std::atomic_thread_fence(std::memory_order_acquire);
+    if(seg->seq.load(std::memory_order_relaxed) != before) continue;
+
+    memcpy(out->v, &lo, 8);
+    memcpy(out->v + 8, &hi, 8);
+    out->pc = regs & 0xFFFF;
+    out->i = regs >> 16 & 0xFFFF;
+    out->sp = regs >> 32 & 0xFF;
+    out->dt = regs >> 40 & 0xFF;
+    out->st = regs >> 48 & 0xFF;
+    return 1;
+  }
+
+  return 0;
+}
+
+}
@@ -0,0 +1,61 @@
+#ifndef __SHM_H__
+#define __SHM_H__
+
+/* live framebuffers published by running instances into POSIX shared
+ * memory. the publisher never waits on readers: it bumps a sequence number
+ * around every update, and a reader retries if the number was odd or
+ * changed while it was copying */
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct chip8_shm chip8_shm;
+
+typedef struct {
+  uint64_t frame; /* frames published so far, one per 60Hz tick */
+  uint64_t rows[32]; /* one bit per pixel, leftmost pixel in the high bit */
+  uint8_t v[16];
+  uint16_t pc, i;
+  uint8_t sp, dt, st;
+} chip8_shm_frame;
+
+/* name as given to the publisher, e.g. "/chip8.0". returns null if there is
+ * no such segment or it isn't one of ours */
+chip8_shm* chip8_shm_open(const char* name);
+void chip8_shm_close(chip8_shm* s);
+
+/* frames published so far, cheap enough to poll for a new one */
+uint64_t chip8_shm_frame_count(chip8_shm* s);
+
+/* copies out the latest consistent frame. returns 0 if the publisher kept
+ * it busy through every retry */
+int chip8_shm_read(chip8_shm* s, chip8_shm_frame* out);
+
+#ifdef __cplusplus
+}
+
+#include <string>
+
+namespace chip8 {
+  struct shm_segment;
+
+  struct shm_publisher {
+    std::string name;
+    shm_segment* seg;
+
+    shm_publisher(const char* name); // creates or takes over the segment
+
+    bool ok();
+
+    void publish(const uint64_t* rows, const uint8_t* v, uint16_t pc, uint16_t I,
+                 uint8_t sp, uint8_t dt, uint8_t st);
+
+    ~shm_publisher(); // removes the segment
+  };
+}
+#endif
+
+#endif /*__SHM_H__*/
@@ -0,0 +1,206 @@
+#include <iostream>
+#include <string>
+#include <cstdio>
+#include <cstdlib>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <vector>
+#include <algorithm>
+#include <unistd.h>
+
+#include "shm.h"
+
+using namespace std;
+
+void usage() {
+  cerr << "usage: shmview watch <name> [-n frames] [-q]\n"
+       << "       shmview test [-n reads]\n"
+       << "       shmview fair <name> <instances> [-t ms]\n";
+}
+
+void show(const chip8_shm_frame& f) {
+  string out;
+  for(int y = 0; y < 32; y++) {
+    for(int x = 0; x < 64; x++) out += f.rows[y] >> (63 - x) & 1 ? '#' : '.';
+    out += '\n';
+  }
+
+  char buf[256];
+  snprintf(buf, sizeof(buf), "frame %llu pc %03x I %03x sp %x dt %02x st %02x\nV:",
+           (unsigned long long)f.frame, f.pc, f.i, f.sp, f.dt, f.st);
+  out += buf;
+  for(int i = 0; i < 16; i++) {
+    snprintf(buf, sizeof(buf), " %02x", f.v[i]);
+    out += buf;
+  }
+
+  // redraw in place
+  cout << "\033[H\033[2J" << out << endl;
+}
+
+int watch(int argc, char** argv) {
+  if(argc < 1) {
+    usage();
+    return 1;
+  }
+
+  long limit = -1;
+  bool quiet = false;
+  for(int i = 1; i < argc; i++) {
+    string arg = argv[i];
+    if(arg == "-n" && i + 1 < argc) limit = atol(argv[++i]);
+    else if(arg == "-q") quiet = true;
+    else {
+      usage();
+      return 1;
+    }
+  }
+
+  chip8_shm* s = chip8_shm_open(argv[0]);
+  if(!s) {
+    cerr << "no framebuffer published as " << argv[0] << endl;
+    return 1;
+  }
+
+  uint64_t last = chip8_shm_frame_count(s);
+  long seen = 0, missed = 0, busy = 0;
+  chip8_shm_frame f;
+
+  while(limit < 0 || seen < limit) {
+    uint64_t count = chip8_shm_frame_count(s);
+    if(count == last) {
+      this_thread::sleep_for(chrono::milliseconds(1));
+      continue;
+    }
+
+    if(!chip8_shm_read(s, &f)) {
+      busy++;
+      continue;
+    }
+
+    missed += f.frame - last - 1;
+    last = f.frame;
+    seen++;
+    if(!quiet) show(f);
+  }
+
+  cout << seen << " frames, " << missed << " skipped, " << busy << " reads gave up" << endl;
+  chip8_shm_close(s);
+  return 0;
+}
+
+// publishes frames whose every field is derived from the frame number as
+// fast as possible, and checks that the reader never sees a mix of two
+int test(int argc, char** argv) {
+  long reads = 1000000;
+  if(argc >= 2 && string(argv[0]) == "-n") reads = atol(argv[1]);
+
+  string name = "/chip8.shmview." + to_string(getpid());
+  chip8::shm_publisher pub(name.c_str());
+  if(!pub.ok()) {
+    cerr << "failed to create " << name << endl;
+    return 1;
+  }
+
+  atomic<bool> running(true);
+  thread writer([&]() {
+    uint64_t rows[32];
+    uint8_t v[16];
+    for(uint64_t n = 1; running; n++) {
+      for(int i = 0; i < 32; i++) rows[i] = n * (i + 1);
+      for(int i = 0; i < 16; i++) v[i] = n + i;
+      pub.publish(rows, v, n & 0xFFFF, ~n & 0xFFFF, n & 0xFF, n >> 8 & 0xFF, n >> 16 & 0xFF);
+    }
+  });
+
+  chip8_shm* s = chip8_shm_open(name.c_str());
+  if(!s) {
+    cerr << "failed to open " << name << endl;
+    running = false;
+    writer.join();
+    return 1;
+  }
+
+  long torn = 0, busy = 0;
+  chip8_shm_frame f;
+  for(long i = 0; i < reads; i++) {
+    if(!chip8_shm_read(s, &f)) {
+      busy++;
+      continue;
+    }
+
+    uint64_t n = f.frame;
+    bool ok = n == 0 || (f.pc == (n & 0xFFFF) && f.i == (~n & 0xFFFF) &&
+                         f.sp == (n & 0xFF) && f.dt == (n >> 8 & 0xFF) && f.st == (n >> 16 & 0xFF));
+    for(int j = 0; n && j < 32; j++) ok = ok && f.rows[j] == n * (j + 1);
+    for(int j = 0; n && j < 16; j++) ok = ok && f.v[j] == (uint8_t)(n + j);
+    if(!ok) torn++;
+  }
+
+  running = false;
+  writer.join();
+
+  cout << reads << " reads up to frame " << chip8_shm_frame_count(s) << ": "
+       << torn << " torn, " << busy << " gave up" << endl;
+  chip8_shm_close(s);
+  return torn ? 1 : 0;
+}
+
+// watches the frames published by every instance of a tiled run
+// (name.0, name.1, ...) for a while, and fails if the scheduler let any of
+// them fall behind. they all tick at 60Hz while they get cpu time, so a
+// starved instance shows up as a low count
+int fair(int argc, char** argv) {
+  if(argc < 2) {
+    usage();
+    return 1;
+  }
+
+  int n = atoi(argv[1]);
+  long ms = 2000;
+  if(argc >= 4 && string(argv[2]) == "-t") ms = atol(argv[3]);
+
+  vector<chip8_shm*> segs;
+  for(int i = 0; i < n; i++) {
+    string name = string(argv[0]) + "." + to_string(i);
+    chip8_shm* s = chip8_shm_open(name.c_str());
+    if(!s) {
+      cerr << "no framebuffer published as " << name << endl;
+      for(auto s: segs) chip8_shm_close(s);
+      return 1;
+    }
+    segs.push_back(s);
+  }
+
+  vector<uint64_t> start;
+  for(auto s: segs) start.push_back(chip8_shm_frame_count(s));
+  this_thread::sleep_for(chrono::milliseconds(ms));
+
+  vector<uint64_t> frames;
+  for(int i = 0; i < n; i++) {
+    frames.push_back(chip8_shm_frame_count(segs[i]) - start[i]);
+    chip8_shm_close(segs[i]);
+    cout << (i ? " " : "") << frames[i];
+  }
+  cout << endl;
+
+  uint64_t lo = *min_element(frames.begin(), frames.end());
+  uint64_t hi = *max_element(frames.begin(), frames.end());
+  return lo * 2 < hi ? 1 : 0;
+}
+
+int main(int argc, char** argv) {
+  if(argc < 2) {
+    usage();
+    return 1;
+  }
+
+  string cmd = argv[1];
+  if(cmd == "watch") return watch(argc - 2, argv + 2);
+  if(cmd == "test") return test(argc - 2, argv + 2);
+  if(cmd == "fair") return fair(argc - 2, argv + 2);
+
+  usage();
+  return 1;
+}
@@ -0,0 +1,221 @@
+#include "trace.h"
+
+#ifndef NO_SDL
+#include "sdl.h"
+#endif
+
+namespace chip8 {
+  static void put16(uint8_t* p, uint16_t val) {
+    p[0] = val & 0xFF;
+    p[1] = val >> 8;
+  }
+
+  trace_writer::trace_writer(const char* path, size_t buffer_size)
+    : buf(buffer_size), used(0), count(0), pending_len(0), pending_writes(0) {
+    out = fopen(path, "wb");
+    if(!out) return;
+
+    uint8_t header[8];
+    memcpy(header, TRACE_MAGIC, 4);
+    header[4] = TRACE_VERSION;
+    header[5] = header[6] = header[7] = 0;
+    fwrite(header, 1, 8, out);
+  }
+
+  bool trace_writer::ok() {
+    return out != 0;
+  }
+
+  template <typename addressable_t, typename runtime_t>
+  void trace_writer::update(cpu* c, addressable_t* mem, runtime_t* r, bool print) {
+    uint16_t pc = c->pc;
+    uint16_t I = c->I;
+    uint16_t sp = c->sp;
+    uint8_t v[16];
+    memcpy(v, c->v, 16);
+
+    uint16_t opcode;
+    traced_mem<addressable_t> tm(mem, this);
+    try {
+      opcode = mem->get(pc) << 8 | mem->get(pc + 1);
+      c->update(&tm, r, print);
+    }
+    catch(fault& f) {
+      // the faulting instruction leaves no record, and none of its writes
+      pending_len = pending_writes = 0;
+      if(f.pc < 0) f.pc = pc;
+      throw;
+    }
+
+    // worst case record is 7 + 16 + 2 + 3 + 1 bytes plus the writes
+    if(used + 32 + pending_len > buf.size()) flush();
+    uint8_t* p = buf.data() + used;
+
+    uint16_t mask = 0;
+    uint8_t* vals = p + 7;
+    for(int i = 0; i < 16; i++) {
+      if(v[i] != c->v[i]) {
+        mask |= 1 << i;
+        *(vals++) = c->v[i];
+      }
+    }
+
+    uint8_t flags = 0;
+    if(c->I != I) {
+      flags |= TRACE_I;
+      put16(vals, c->I); vals += 2;
+    }
+    if(c->sp != sp) {
+      flags |= TRACE_SP;
+      *(vals++) = c->sp;
+      put16(vals, c->stack[c->sp ? c->sp - 1 : 0]); vals += 2;
+    }
+    if(pending_writes) {
+      flags |= TRACE_MEM;
+      *(vals++) = pending_writes;
+      memcpy(vals, pending, pending_len); vals += pending_len;
+      pending_len = pending_writes = 0;
+    }
+
+    put16(p, pc);
+    put16(p + 2, opcode);
+    put16(p + 4, mask);
+    p[6] = flags;
+
+    used = vals - buf.data();
+    count++;
+  }
+
+  void trace_writer::mem_write(int addr, const void* data, int count) {
+    // the largest single write is a 16 register backup
+    if(pending_len + 3 + count > (int)sizeof(pending)) return;
+
+    put16(pending + pending_len, addr);
+    pending[pending_len + 2] = count;
+    memcpy(pending + pending_len + 3, data, count);
+    pending_len += 3 + count;
+    pending_writes++;
+  }
+
+  void trace_writer::flush() {
+    if(out && used) fwrite(buf.data(), 1, used, out);
+    used = 0;
+  }
+
+  trace_writer::~trace_writer() {
+    if(!out) return;
+    flush();
+    fclose(out);
+  }
+
+  trace_reader::trace_reader(const char* path): count(0) {
+    in = fopen(path, "rb");
+    if(!in) return;
+
+    uint8_t header[8];
+    if(fread(header, 1, 8, in) != 8 ||
+       memcmp(header, TRACE_MAGIC, 4) ||
+       header[4] != TRACE_VERSION) {
+      fclose(in);
+      in = 0;
+    }
+  }
+
+  bool trace_reader::ok() {
+    return in != 0;
+  }
+
+  static bool get8(FILE* in, uint8_t& val) {
+    int c = fgetc(in);
+    val = c;
+    return c != EOF;
+  }
+
+  static bool get16(FILE* in, uint16_t& val) {
+    uint8_t p[2];
+    if(fread(p, 1, 2, in) != 2) return false;
+    val = p[0] | p[1] << 8;
+    return true;
+  }
+
+  bool trace_reader::next(trace_record& rec) {
+    if(!in) return false;
+
+    rec.count = count;
+    rec.writes.clear();
+    if(!get16(in, rec.pc) || !get16(in, rec.opcode) ||
+       !get16(in, rec.reg_mask) || !get8(in, rec.flags)) return false;
+
+    for(int i = 0; i < 16; i++) {
+      if(rec.reg_mask & (1 << i) && !get8(in, rec.v[i])) return false;
+    }
+
+    if(rec.flags & TRACE_I && !get16(in, rec.I)) return false;
+    if(rec.flags & TRACE_SP && (!get8(in, rec.sp) || !get16(in, rec.stack))) return false;
+
+    if(rec.flags & TRACE_MEM) {
+      uint8_t n;
+      if(!get8(in, n)) return false;
+
+      rec.writes.resize(n);
+      for(auto& w: rec.writes) {
+        uint8_t len;
+        if(!get16(in, w.addr) || !get8(in, len)) return false;
+        w.bytes.resize(len);
+        if(fread(w.bytes.data(), 1, len, in) != len) return false;
+      }
+    }
+
+    count++;
+    return true;
+  }
+
+  trace_reader::~trace_reader() {
+    if(in) fclose(in);
+  }
+
+  std::string trace_record::to_string() {
+    char buf[256];
+    cpu::instr i = cpu::decode(opcode >> 8, opcode & 0xFF);
+    int n = snprintf(buf, sizeof(buf), "%llu %03x: %04x %-16s",
+                     (unsigned long long)count, pc, opcode,
+                     i.op < 0 ? "unknown" : debug_str[i.op]);
+    std::string ret(buf, n);
+
+    for(int r = 0; r < 16; r++) {
+      if(reg_mask & (1 << r)) {
+        snprintf(buf, sizeof(buf), " v%x=%02x", r, v[r]);
+        ret += buf;
+      }
+    }
+
+    if(flags & TRACE_I) {
+      snprintf(buf, sizeof(buf), " I=%03x", I);
+      ret += buf;
+    }
+
+    if(flags & TRACE_SP) {
+      snprintf(buf, sizeof(buf), " sp=%x [%03x]", sp, stack);
+      ret += buf;
+    }
+
+    for(auto& w: writes) {
+      snprintf(buf, sizeof(buf), " [%03x]=", w.addr);
+      ret += buf;
+      for(uint8_t b: w.bytes) {
+        snprintf(buf, sizeof(buf), "%02x", b);
+        ret += buf;
+      }
+    }
+
+    return ret;
+  }
+
+  // force instantiate the template functions
+  void FORCE_DEFINE__trace() {
+#ifndef NO_SDL
+    { auto _ = &trace_writer::update<dram, sdl_runtime<dram> >; }
+    { auto _ = &trace_writer::update<dram, headless_runtime<dram> >; }
+#endif
+  }
+}
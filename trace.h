@@ -0,0 +1,105 @@
+#ifndef __TRACE_H__
+#define __TRACE_H__
+
+#include "core.h"
+
+#include <cstdio>
+#include <vector>
+
+namespace chip8 {
+  // binary execution trace, one variable length record per instruction:
+  //
+  //   u16 pc, u16 opcode, u16 mask of changed v registers, u8 flags
+  //   u8 value for every changed v register (in order)
+  //   u16 I              if flags & TRACE_I
+  //   u8 sp, u16 stack   if flags & TRACE_SP (stack is the entry under sp)
+  //   u8 write count     if flags & TRACE_MEM, then for each write:
+  //     u16 addr, u8 count, count bytes
+  //
+  // all values are little endian, the instruction count is the record index
+
+  enum {
+        TRACE_I = 1,
+        TRACE_SP = 2,
+        TRACE_MEM = 4
+  };
+
+  static const char TRACE_MAGIC[4] = {'C', '8', 'T', 'R'};
+  static const int TRACE_VERSION = 1;
+
+  struct trace_record {
+    uint64_t count;
+    uint16_t pc, opcode;
+    uint16_t reg_mask;
+    uint8_t flags;
+    uint8_t v[16]; // only entries in reg_mask are valid
+    uint16_t I;
+    uint8_t sp;
+    uint16_t stack;
+
+    struct mem_write {
+      uint16_t addr;
+      std::vector<uint8_t> bytes;
+    };
+    std::vector<mem_write> writes;
+
+    std::string to_string();
+  };
+
+  struct trace_writer {
+    FILE* out;
+
+    std::vector<uint8_t> buf; // flushed to the file when full
+    size_t used;
+    uint64_t count;
+
+    // memory writes made by the instruction currently executing
+    uint8_t pending[64];
+    int pending_len;
+    int pending_writes;
+
+    trace_writer(const char* path, size_t buffer_size = 1 << 16);
+
+    bool ok();
+
+    // execute one instruction and record its effects
+    template <typename addressable_t, typename runtime_t>
+    void update(cpu* c, addressable_t* mem, runtime_t* r, bool print = false);
+
+    void mem_write(int addr, const void* data, int count);
+    void flush();
+
+    ~trace_writer();
+  };
+
+  // forwards to the real memory, reporting writes to the trace
+  template <typename addressable_t>
+  struct traced_mem: addressable {
+    addressable_t* mem;
+    trace_writer* trace;
+
+    traced_mem(addressable_t* mem, trace_writer* trace): mem(mem), trace(trace) {}
+
+    void write(int addr, void* buf, int count) {
+      trace->mem_write(addr, buf, count);
+      mem->write(addr, buf, count);
+    }
+
+    void read(int addr, void* buf, int count) { mem->read(addr, buf, count); }
+    uint8_t get(int addr) { return mem->get(addr); }
+  };
+
+  struct trace_reader {
+    FILE* in;
+    uint64_t count;
+
+    trace_reader(const char* path);
+
+    bool ok();
+    bool next(trace_record& rec);
+
+    ~trace_reader();
+  };
+}
+
+#endif //__TRACE_H__
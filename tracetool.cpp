@@ -0,0 +1,279 @@
+#include <iostream>
+#include <string>
+#include <cstdlib>
+#include <map>
+#include <vector>
+#include <algorithm>
+#include <cstring>
+
+#include "trace.h"
+
+using namespace std;
+
+void usage() {
+  cerr << "usage: tracetool dump <trace> [-f first] [-n count] [-p pc] [-o opcode[/mask]]\n"
+       << "       tracetool diff <trace a> <trace b> [-c context]\n"
+       << "       tracetool pairs <trace> [-n count]\n"
+       << "       tracetool fuse [-n programs] [-s seed]\n";
+}
+
+bool same(chip8::trace_record& a, chip8::trace_record& b) {
+  if(a.pc != b.pc || a.opcode != b.opcode ||
+     a.reg_mask != b.reg_mask || a.flags != b.flags) return false;
+
+  for(int i = 0; i < 16; i++) {
+    if(a.reg_mask & (1 << i) && a.v[i] != b.v[i]) return false;
+  }
+
+  if(a.flags & chip8::TRACE_I && a.I != b.I) return false;
+  if(a.flags & chip8::TRACE_SP && (a.sp != b.sp || a.stack != b.stack)) return false;
+
+  if(a.writes.size() != b.writes.size()) return false;
+  for(size_t i = 0; i < a.writes.size(); i++) {
+    if(a.writes[i].addr != b.writes[i].addr ||
+       a.writes[i].bytes != b.writes[i].bytes) return false;
+  }
+
+  return true;
+}
+
+int dump(int argc, char** argv) {
+  chip8::trace_reader in(argv[0]);
+  if(!in.ok()) {
+    cerr << "can't read trace: " << argv[0] << endl;
+    return 1;
+  }
+
+  uint64_t first = 0, n = -1;
+  int pc = -1;
+  int op = -1, op_mask = 0xFFFF;
+
+  for(int i = 1; i + 1 < argc; i += 2) {
+    string arg = argv[i];
+    if(arg == "-f") first = strtoull(argv[i + 1], 0, 0);
+    else if(arg == "-n") n = strtoull(argv[i + 1], 0, 0);
+    else if(arg == "-p") pc = strtol(argv[i + 1], 0, 16);
+    else if(arg == "-o") {
+      // e.g. "d000/f000" matches every draw
+      char* end;
+      op = strtol(argv[i + 1], &end, 16);
+      if(*end == '/') op_mask = strtol(end + 1, 0, 16);
+    }
+    else { usage(); return 1; }
+  }
+
+  chip8::trace_record rec;
+  while(n && in.next(rec)) {
+    if(rec.count < first) continue;
+    if(pc >= 0 && rec.pc != pc) continue;
+    if(op >= 0 && (rec.opcode & op_mask) != (op & op_mask)) continue;
+
+    cout << rec.to_string() << "\n";
+    n--;
+  }
+
+  return 0;
+}
+
+int diff(int argc, char** argv) {
+  chip8::trace_reader a(argv[0]), b(argv[1]);
+  if(!a.ok() || !b.ok()) {
+    cerr << "can't read trace: " << (a.ok() ? argv[1] : argv[0]) << endl;
+    return 1;
+  }
+
+  int context = 8;
+  if(argc == 4 && string(argv[2]) == "-c") context = atoi(argv[3]);
+
+  // keep the last few matching records to show what led up to the divergence
+  vector<chip8::trace_record> history(context);
+  chip8::trace_record ra, rb;
+
+  while(true) {
+    bool more_a = a.next(ra);
+    bool more_b = b.next(rb);
+
+    if(!more_a && !more_b) {
+      cout << "traces are identical (" << a.count << " instructions)" << endl;
+      return 0;
+    }
+
+    if(more_a != more_b || !same(ra, rb)) {
+      uint64_t at = more_a ? ra.count : rb.count;
+      cout << "first divergence at instruction " << at << "\n";
+
+      for(uint64_t i = at > (uint64_t)context ? at - context : 0; i < at; i++) {
+        cout << "  " << history[i % context].to_string() << "\n";
+      }
+
+      cout << "a " << (more_a ? ra.to_string() : "<end of trace>") << "\n";
+      cout << "b " << (more_b ? rb.to_string() : "<end of trace>") << endl;
+      return 2;
+    }
+
+    if(context) history[ra.count % context] = ra;
+  }
+}
+
+// the most frequent consecutive instruction pairs. saved to a file, this is
+// the profile main -F loads to pick which fused handlers cpu::run uses
+int pairs(int argc, char** argv) {
+  chip8::trace_reader in(argv[0]);
+  if(!in.ok()) {
+    cerr << "can't read trace: " << argv[0] << endl;
+    return 1;
+  }
+
+  int n = 20;
+  if(argc == 3 && string(argv[1]) == "-n") n = atoi(argv[2]);
+
+  map<pair<int, int>, uint64_t> counts;
+  chip8::trace_record rec;
+  int prev = -2;
+  while(in.next(rec)) {
+    int op = chip8::cpu::decode(rec.opcode >> 8, rec.opcode & 0xFF).op;
+    if(prev != -2) counts[make_pair(prev, op)]++;
+    prev = op;
+  }
+
+  vector<pair<uint64_t, pair<int, int> > > sorted;
+  for(auto& c: counts) {
+    sorted.push_back(make_pair(c.second, c.first));
+  }
+  sort(sorted.rbegin(), sorted.rend());
+
+  uint64_t total = in.count > 1 ? in.count - 1 : 1;
+  for(int i = 0; i < n && i < (int)sorted.size(); i++) {
+    int a = sorted[i].second.first, b = sorted[i].second.second;
+    printf("%6.2f%% %12llu  %s + %s\n", sorted[i].first * 100. / total,
+           (unsigned long long)sorted[i].first,
+           a < 0 ? "unknown" : chip8::debug_str[a],
+           b < 0 ? "unknown" : chip8::debug_str[b]);
+  }
+
+  return 0;
+}
+
+// one machine, stepped either by cpu::run or by cpu::update on its own
+struct machine {
+  chip8::dram ram;
+  chip8::headless_runtime<chip8::dram> runtime;
+  chip8::cpu core;
+  int done;
+  int fault_pc; // -1 unless it faulted
+
+  machine(const uint8_t* code, int addr, int size, uint64_t seed, int fused)
+    : runtime(&ram, seed), core(addr), done(0), fault_pc(-1) {
+    ram.write(addr, (void*)code, size);
+    core.pairs.enabled = fused;
+    core.pairs.profiled = -1;
+  }
+
+  void run(int n, bool fused) {
+    try {
+      if(fused) done = core.run(&ram, &runtime, n);
+      else {
+        while(done < n) {
+          uint16_t pc = core.pc;
+          core.update(&ram, &runtime);
+          done++;
+          if(core.pc == pc) break;
+        }
+      }
+    }
+    catch(const chip8::fault& f) {
+      fault_pc = f.pc;
+    }
+  }
+
+  bool operator==(machine& o) {
+    // run doesn't get to return its count when it faults
+    if(fault_pc < 0 && done != o.done) return false;
+    if(fault_pc != o.fault_pc || core.pc != o.core.pc || core.I != o.core.I ||
+       core.sp != o.core.sp || memcmp(core.v, o.core.v, sizeof(core.v)) ||
+       memcmp(runtime.fb.rows, o.runtime.fb.rows, sizeof(runtime.fb.rows))) return false;
+
+    uint8_t a[chip8::dram::SIZE], b[chip8::dram::SIZE];
+    ram.read(0, a, sizeof(a));
+    o.ram.read(0, b, sizeof(b));
+    return !memcmp(a, b, sizeof(a));
+  }
+};
+
+// checks that cpu::run, with its fused pairs and carried over decodes,
+// ends up exactly where running the same instructions one by one does.
+// programs run off the end of memory, so not for the checked memory policy
+bool same_as_update(const uint8_t* code, int addr, int size, int n, uint64_t seed,
+                    int fused = (1 << chip8::fusion::PAIRS) - 1) {
+  machine a(code, addr, size, seed, fused), b(code, addr, size, seed, 0);
+  a.run(n, true);
+  b.run(n, false);
+  if(a == b) return true;
+
+  printf("mismatch: %d bytes at %03x, %d instructions, seed %llu: run stopped at %x (%d, fault %d), "
+         "update at %x (%d, fault %d)\n", size, addr, n, (unsigned long long)seed,
+         a.core.pc, a.done, a.fault_pc, b.core.pc, b.done, b.fault_pc);
+  return false;
+}
+
+int fuse(int argc, char** argv) {
+  int n = 3000;
+  unsigned seed = 1;
+  for(int i = 0; i + 1 < argc; i += 2) {
+    string arg = argv[i];
+    if(arg == "-n") n = atoi(argv[i + 1]);
+    else if(arg == "-s") seed = strtoul(argv[i + 1], 0, 0);
+    else { usage(); return 1; }
+  }
+  srand(seed);
+
+  int bad = 0;
+
+  // the lookahead can't decode past the last byte of memory, so code
+  // running into the end has to fall back to a plain fetch
+  const uint8_t tail[] = { 0x60, 0x01, 0x70, 0x01 }; // LD v0, 1; ADD v0, 1
+  for(int k = 1; k <= 4; k++) {
+    if(!same_as_update(tail, 0xFFC, sizeof(tail), k, 0)) bad++;
+  }
+
+  // random programs, biased towards the pairs cpu::run fuses, placed
+  // anywhere in memory and jumping around inside themselves
+  static const uint16_t hot[] = { 0xA000, 0xD000, 0x3000, 0x4000, 0x7000, 0xF007, 0xF029, 0xF033 };
+  for(int t = 0; t < n; t++) {
+    int words = 1 + rand() % 128;
+    int addr = (rand() % ((chip8::dram::SIZE - 2 * words) / 2 + 1)) * 2;
+    if(rand() % 4 == 0) addr = chip8::dram::SIZE - 2 * words;
+
+    uint8_t code[256];
+    for(int i = 0; i < words; i++) {
+      uint16_t op = rand() & 0xFFFF;
+      int k = rand() % 10;
+      if(k < 8) op = hot[k] | (rand() & 0xFFF);
+      else if(k == 8) op = 0x1000 | (addr + rand() % words * 2);
+      // no machine code routines, or anything that only prints a warning
+      if(op >> 12 == 0 || chip8::cpu::decode(op >> 8, op & 0xFF).op < 0) op = 0x00E0;
+      code[i * 2] = op >> 8;
+      code[i * 2 + 1] = op;
+    }
+
+    // every handler, or a random set of them as a profile would pick
+    int fused = rand() % 2 ? (1 << chip8::fusion::PAIRS) - 1 : rand() % (1 << chip8::fusion::PAIRS);
+    if(!same_as_update(code, addr, words * 2, 1 + rand() % 64, t, fused)) bad++;
+  }
+
+  printf("%d of %d programs differ\n", bad, n + 4);
+  return bad != 0;
+}
+
+int main(int argc, char** argv) {
+  if(argc < 2) { usage(); return 1; }
+
+  string cmd = argv[1];
+  if(cmd == "dump" && argc >= 3) return dump(argc - 2, argv + 2);
+  if(cmd == "diff" && argc >= 4) return diff(argc - 2, argv + 2);
+  if(cmd == "pairs" && argc >= 3) return pairs(argc - 2, argv + 2);
+  if(cmd == "fuse") return fuse(argc - 2, argv + 2);
+
+  usage();
+  return 1;
+}